@@ -0,0 +1,156 @@
+#include "stable.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <sys/time.h>
+
+#define PINGPONG 100000
+#define MAX_THREAD 4
+#define MAX_COUNT 200000
+#define CHANNEL_SIZE 256
+
+static double
+now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+struct pair {
+	struct stable_channel *ping;
+	struct stable_channel *pong;
+};
+
+static void *
+thread_pong(void *ptr) {
+	struct pair *p = ptr;
+	int i;
+	for (i=0;i<PINGPONG;i++) {
+		struct table *t = stable_channel_recv(p->ping, 1);
+		stable_addinteger(t, TKEY("count"), 1, NULL);
+		stable_channel_send(p->pong, t, 1);
+	}
+	return NULL;
+}
+
+// one table goes back and forth, the round trip time is the wakeup latency
+static void
+pingpong() {
+	struct pair p;
+	p.ping = stable_channel_create(1);
+	p.pong = stable_channel_create(1);
+	struct table *t = stable_create();
+	pthread_t pid;
+	pthread_create(&pid, NULL, thread_pong, &p);
+	double start = now();
+	int i;
+	for (i=0;i<PINGPONG;i++) {
+		stable_channel_send(p.ping, t, 1);
+		t = stable_channel_recv(p.pong, 1);
+	}
+	double elapsed = now() - start;
+	pthread_join(pid, NULL);
+	assert(stable_integer(t, TKEY("count")) == PINGPONG);
+	assert(stable_getref(t) == 1);
+	printf("ping-pong : %.2f us per round trip\n", elapsed * 1000000 / PINGPONG);
+	stable_release(t);
+	stable_channel_release(p.ping);
+	stable_channel_release(p.pong);
+}
+
+struct worker {
+	struct stable_channel *c;
+	struct table *t;
+	int64_t sum;
+};
+
+static void *
+thread_send(void *ptr) {
+	struct worker *w = ptr;
+	int i;
+	for (i=0;i<MAX_COUNT;i++) {
+		// the reference grabbed here is moved into the channel
+		stable_grab(w->t);
+		stable_channel_send(w->c, w->t, 1);
+	}
+	return NULL;
+}
+
+static void *
+thread_recv(void *ptr) {
+	struct worker *w = ptr;
+	int i;
+	for (i=0;i<MAX_COUNT;i++) {
+		struct table *t = stable_channel_recv(w->c, 1);
+		w->sum += stable_integer(t, TKEY("id"));
+		stable_release(t);
+	}
+	return NULL;
+}
+
+static void
+throughput() {
+	pthread_t pid[MAX_THREAD * 2];
+	struct worker w[MAX_THREAD * 2];
+	struct stable_channel *c = stable_channel_create(CHANNEL_SIZE);
+	struct table *root = stable_create();
+	int i;
+	int64_t expect = 0;
+	for (i=0;i<MAX_THREAD;i++) {
+		w[i].c = c;
+		w[i].t = stable_create_child(root);
+		stable_setinteger(w[i].t, TKEY("id"), i);
+		expect += (int64_t)i * MAX_COUNT;
+		w[MAX_THREAD + i].c = c;
+		w[MAX_THREAD + i].sum = 0;
+	}
+	double start = now();
+	for (i=0;i<MAX_THREAD*2;i++) {
+		pthread_create(&pid[i], NULL, i < MAX_THREAD ? thread_send : thread_recv, &w[i]);
+	}
+	int64_t sum = 0;
+	for (i=0;i<MAX_THREAD*2;i++) {
+		pthread_join(pid[i], NULL);
+		if (i >= MAX_THREAD) {
+			sum += w[i].sum;
+		}
+	}
+	double elapsed = now() - start;
+	assert(sum == expect);
+	printf("%d senders %d receivers : %.0f handles/s\n", MAX_THREAD, MAX_THREAD, MAX_THREAD * MAX_COUNT / elapsed);
+	for (i=0;i<MAX_THREAD;i++) {
+		assert(stable_getref(w[i].t) == 1);
+		stable_release(w[i].t);
+	}
+	stable_release(root);
+	stable_channel_release(c);
+}
+
+static void
+nonblock() {
+	struct stable_channel *c = stable_channel_create(4);
+	struct table *t = stable_create();
+	int i;
+	assert(stable_channel_recv(c, 0) == NULL);
+	for (i=0;i<4;i++) {
+		stable_grab(t);
+		assert(stable_channel_send(c, t, 0) == 0);
+	}
+	assert(stable_channel_send(c, t, 0) == 1);
+	assert(stable_channel_recv(c, 0) == t);
+	stable_release(t);
+	assert(stable_getref(t) == 4);
+	// the references left in the channel are dropped with it
+	stable_channel_release(c);
+	assert(stable_getref(t) == 1);
+	stable_release(t);
+}
+
+int
+main() {
+	nonblock();
+	pingpong();
+	throughput();
+	return 0;
+}
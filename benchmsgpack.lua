@@ -0,0 +1,60 @@
+local s = require "stable.raw"
+
+s.init()
+
+-- a tree of 1000 records, each with a few fields and an array of 16 numbers
+local function build()
+	local src = {}
+	for i = 1, 1000 do
+		local values = {}
+		for j = 1, 16 do
+			values[j] = i * j + 0.5
+		end
+		src["record" .. i] = {
+			id = i,
+			name = "name of record " .. i,
+			enabled = i % 2 == 0,
+			values = values,
+		}
+	end
+	return s.create(src)
+end
+
+-- walk the tree with pairs into lua tables, as a snapshot was shipped before
+local function walk(t)
+	local ret = {}
+	for k,v in pairs(t) do
+		if type(v) == "userdata" then
+			ret[k] = walk(v)
+		else
+			ret[k] = v
+		end
+	end
+	return ret
+end
+
+local function bench(name, n, f)
+	local start = os.clock()
+	for i = 1, n do
+		f()
+	end
+	print(string.format("%s : %.3f ms", name, (os.clock() - start) * 1000 / n))
+end
+
+local t = build()
+local ROUND = 20
+
+bench("lua round trip (pairs, create)", ROUND, function()
+	s.decref(s.create(walk(t)))
+end)
+
+bench("msgpack round trip (encode, decode)", ROUND, function()
+	s.decref(s.decode(s.encode(t)))
+end)
+
+local data = s.encode(t)
+print("msgpack size", #data)
+bench("encode", ROUND, function() s.encode(t) end)
+bench("decode", ROUND, function() s.decref(s.decode(data)) end)
+
+s.decref(t)
@@ -0,0 +1,93 @@
+#include "stable.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/time.h>
+
+#define MAX_THREAD 8
+#define MAX_COUNT 200000
+
+static int done = 0;
+static const char * format = NULL;
+
+static double
+now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void
+_check(void *ud, const char *str, size_t sz) {
+	// every version of the value is "value:" followed by a number
+	assert(sz > 6 && memcmp(str, "value:", 6) == 0);
+	*(size_t *)ud += sz;
+}
+
+static void *
+thread_write(void *ptr) {
+	struct table * t = ptr;
+	char buf[64];
+	int i;
+	for (i=0;i<MAX_COUNT;i++) {
+		sprintf(buf, format, i);
+		stable_setstring(t, TKEY("status"), buf, strlen(buf));
+	}
+	__sync_lock_test_and_set(&done, 1);
+	return NULL;
+}
+
+static void *
+thread_read(void *ptr) {
+	struct table * t = ptr;
+	size_t bytes = 0;
+	size_t n = 0;
+	while (!done) {
+		stable_string(t, TKEY("status"), _check, &bytes);
+		++n;
+	}
+	return (void *)n;
+}
+
+static void
+bench(const char *fmt) {
+	pthread_t pid[MAX_THREAD];
+	struct table * t = stable_create();
+	stable_setstring(t, TKEY("status"), TKEY("value:init"));
+	format = fmt;
+	done = 0;
+
+	double start = now();
+	pthread_create(&pid[0], NULL, thread_write, t);
+	int i;
+	for (i=1;i<MAX_THREAD;i++) {
+		pthread_create(&pid[i], NULL, thread_read, t);
+	}
+	size_t reads = 0;
+	for (i=0;i<MAX_THREAD;i++) {
+		void *n;
+		pthread_join(pid[i], &n);
+		if (i > 0) {
+			reads += (size_t)n;
+		}
+	}
+	double elapsed = now() - start;
+
+	printf("%s : 1 writer %d readers : %.0f writes/s %.0f reads/s\n",
+		fmt, MAX_THREAD - 1, MAX_COUNT / elapsed, reads / elapsed);
+
+	struct stable_memory mem;
+	stable_memory(t, &mem);
+	printf("memory total=%zu retired=%zu\n", mem.total, mem.retired);
+
+	stable_release(t);
+}
+
+int
+main() {
+	bench("value:%d");	// short, stored in the value slot
+	bench("value:%d, longer than a short string");
+	return 0;
+}
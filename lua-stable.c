@@ -3,8 +3,51 @@
 #include <lauxlib.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 
 #define MAX_DEPTH 16
+#define STRING_COPY 256
+
+#ifndef LUA_MAXINTEGER
+// lua_Integer is ptrdiff_t before lua 5.3
+#define LUA_MAXINTEGER PTRDIFF_MAX
+#endif
+
+/*
+	A long string is read in an epoch (see stable_value_string), which a lua
+	error must not jump out of : a string up to STRING_COPY bytes is copied
+	on the stack and pushed after, a longer one is pushed in a protected call.
+ */
+struct string_push {
+	lua_State *L;
+	const char *str;
+	size_t sz;
+	int status;	// -1 : copied into buf, or the status of lua_pcall
+	char buf[STRING_COPY];
+};
+
+static int
+_push_string(lua_State *L) {
+	struct string_push *p = lua_touserdata(L,1);
+	lua_pushlstring(L, p->str, p->sz);
+	return 1;
+}
+
+static void
+_read_string(void *ud, const char *str, size_t sz) {
+	struct string_push *p = ud;
+	if (sz <= sizeof(p->buf)) {
+		memcpy(p->buf, str, sz);
+		p->sz = sz;
+		p->status = -1;
+		return;
+	}
+	p->str = str;
+	p->sz = sz;
+	lua_pushcfunction(p->L, _push_string);
+	lua_pushlightuserdata(p->L, p);
+	p->status = lua_pcall(p->L, 1, 1, 0);
+}
 
 static void
 _getvalue(lua_State *L, int ttype, union table_value *tv) {
@@ -21,9 +64,21 @@ _getvalue(lua_State *L, int ttype, union table_value *tv) {
 	case ST_ID:
 		lua_pushlightuserdata(L,(void *)(uintptr_t)tv->id);
 		break;
-	case ST_STRING:
-		stable_value_string(tv,(table_setstring_func)lua_pushlstring,L);
+	case ST_INTEGER:
+		lua_pushinteger(L,(lua_Integer)tv->i);
+		break;
+	case ST_STRING: {
+		struct string_push p;
+		p.L = L;
+		luaL_checkstack(L, 2, NULL);
+		stable_value_string(tv, _read_string, &p);
+		if (p.status < 0) {
+			lua_pushlstring(L, p.buf, p.sz);
+		} else if (p.status != 0) {
+			lua_error(L);
+		}
 		break;
+	}
 	case ST_TABLE:
 		lua_pushlightuserdata(L,tv->p);
 		break;
@@ -32,22 +87,41 @@ _getvalue(lua_State *L, int ttype, union table_value *tv) {
 	}
 }
 
+/*
+	Lua index i is the key i-1. An index <= 0 wraps to a key above
+	MAX_ARRAY_SIZE, so it is kept in the map, and pairs gives it back as
+	(lua_Integer)key + 1 == i. A number without an exact integer value
+	(1.5) is not a key.
+ */
+static size_t
+_index(lua_State *L, int idx) {
+#if LUA_VERSION_NUM >= 503
+	int isnum;
+	lua_Integer i = lua_tointegerx(L,idx,&isnum);
+	if (!isnum) {
+		luaL_error(L,"Unsupport index %f",lua_tonumber(L,idx));
+	}
+#else
+	lua_Number n = lua_tonumber(L,idx);
+	lua_Integer i = (lua_Integer)n;
+	if ((lua_Number)i != n) {
+		luaL_error(L,"Unsupport index %f",n);
+	}
+#endif
+	return (size_t)(i - 1);
+}
+
 static int
 _get(lua_State *L) {
 	struct table * t = lua_touserdata(L,1);
 	int type = lua_type(L,2);
-	int idx;
 	int ttype;
 	union table_value tv;
 	const char *key;
 	size_t sz;
 	switch(type) {
 	case LUA_TNUMBER:
-		idx = lua_tointeger(L,2);
-		if (idx <= 0) {
-			return luaL_error(L,"Unsupport index %d",idx);
-		}
-		ttype = stable_type(t, NULL, idx - 1, &tv);
+		ttype = stable_type(t, NULL, _index(L,2), &tv);
 		break;
 	case LUA_TSTRING:
 		key = lua_tolstring(L,2,&sz);
@@ -63,7 +137,7 @@ _get(lua_State *L) {
 static void
 _error(lua_State *L, const char *key, size_t sz, int type) {
 	if (key == NULL) {
-		luaL_error(L, "Can't set %d with type %s",(int)sz,lua_typename(L,type));
+		luaL_error(L, "Can't set %d with type %s",(int)((lua_Integer)sz + 1),lua_typename(L,type));
 	} else {
 		luaL_error(L, "Can't set %s with type %s",key,lua_typename(L,type));
 	}
@@ -72,17 +146,11 @@ _error(lua_State *L, const char *key, size_t sz, int type) {
 static const char * 
 _get_key(lua_State *L, int key_idx, size_t *sz_idx) {
 	int type = lua_type(L,key_idx);
-	const char *key;
-	size_t sz;
+	const char *key = NULL;
 	switch(type) {
 	case LUA_TNUMBER:
-		sz = lua_tointeger(L,key_idx);
-		if (sz <= 0) {
-			luaL_error(L,"Unsupport index %lu",sz);
-		}
 		key = NULL;
-		sz--;
-		*sz_idx = sz;
+		*sz_idx = _index(L,key_idx);
 		break;
 	case LUA_TSTRING:
 		key = lua_tolstring(L,key_idx,sz_idx);
@@ -93,13 +161,180 @@ _get_key(lua_State *L, int key_idx, size_t *sz_idx) {
 	return key;
 }
 
+/*
+	On lua 5.3+, an integer goes to a new slot as ST_INTEGER. A slot keeps its
+	type, so an integer written to a number slot is stored as a number, and an
+	integral float written to an integer slot is stored as an integer.
+ */
+static int
+_set_number(lua_State *L, struct table * t, const char *key, size_t sz, int idx) {
+#if LUA_VERSION_NUM >= 503
+	if (lua_isinteger(L,idx)) {
+		lua_Integer i = lua_tointeger(L,idx);
+		if (stable_setinteger(t, key, sz, i) == 0) {
+			return 0;
+		}
+		return stable_setnumber(t, key, sz, (double)i);
+	}
+#endif
+	double d = lua_tonumber(L,idx);
+	if (stable_setnumber(t, key, sz, d) == 0) {
+		return 0;
+	}
+	if (d >= -9223372036854775808.0 && d < 9223372036854775808.0 && d == (double)(int64_t)d) {
+		return stable_setinteger(t, key, sz, (int64_t)d);
+	}
+	return 1;
+}
+
+/*
+	The tables created while loading are owned by a guard (a userdata on the
+	stack) until they are set, so the __gc of the guard releases them if a
+	lua error is raised before.
+ */
+struct load_guard {
+	size_t n;
+	struct table *t[1];	// NULL once set
+};
+
+static int
+_guard_gc(lua_State *L) {
+	struct load_guard *g = lua_touserdata(L,1);
+	size_t i;
+	for (i=0;i<g->n;i++) {
+		stable_release(g->t[i]);
+	}
+	g->n = 0;
+	return 0;
+}
+
+static struct load_guard *
+_new_guard(lua_State *L, size_t n) {
+	struct load_guard *g = lua_newuserdata(L, sizeof(*g) + (n-1) * sizeof(struct table *));
+	g->n = 0;
+	luaL_setmetatable(L,"stable.load");
+	return g;
+}
+
+// t is set, its guard is no longer needed
+static void
+_guard_clear(struct load_guard *g) {
+	g->n = 0;
+}
+
+/*
+	Copy the lua table at index into t with one stable_setbatch, nested lua
+	tables are built as child tables first, so each is published once.
+ */
+static void
+_load(lua_State *L, struct table *t, int index, int depth) {
+	if (depth > MAX_DEPTH) {
+		luaL_error(L, "Table is too deep (or has a cycle)");
+	}
+	index = lua_absindex(L, index);
+	luaL_checkstack(L, 5, NULL);
+	size_t n = 0;
+	lua_pushnil(L);
+	while (lua_next(L, index)) {
+		++n;
+		lua_pop(L,1);
+	}
+	if (n == 0) {
+		return;
+	}
+	// a userdata, so it is collected if an error is raised
+	struct table_entry *e = lua_newuserdata(L, n * sizeof(*e));
+	struct load_guard *g = _new_guard(L, n);
+	size_t i = 0;
+	lua_pushnil(L);
+	while (lua_next(L, index)) {
+		struct table_entry *entry = &e[i++];
+		size_t sz;
+		const char *key = _get_key(L, -2, &sz);
+		entry->key.key = key;
+		entry->key.sz_idx = sz;
+		int type = lua_type(L,-1);
+		switch (type) {
+		case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+			if (lua_isinteger(L,-1)) {
+				entry->key.type = ST_INTEGER;
+				entry->v.i = lua_tointeger(L,-1);
+				break;
+			}
+#endif
+			entry->key.type = ST_NUMBER;
+			entry->v.n = lua_tonumber(L,-1);
+			break;
+		case LUA_TBOOLEAN:
+			entry->key.type = ST_BOOLEAN;
+			entry->v.b = lua_toboolean(L,-1);
+			break;
+		case LUA_TSTRING:
+			// the string is kept alive by the lua table
+			entry->key.type = ST_STRING;
+			entry->v.p = (void *)lua_tolstring(L,-1,&entry->sz);
+			break;
+		case LUA_TLIGHTUSERDATA:
+			entry->key.type = ST_ID;
+			entry->v.id = (uint64_t)(uintptr_t)lua_touserdata(L,-1);
+			break;
+		case LUA_TTABLE: {
+			struct table *sub = stable_create_child(t);
+			g->t[g->n++] = sub;
+			entry->key.type = ST_TABLE;
+			entry->v.p = sub;
+			_load(L, sub, -1, depth + 1);
+			break;
+		}
+		default:
+			luaL_error(L,"Unsupport value type %s",lua_typename(L,type));
+		}
+		lua_pop(L,1);
+	}
+	int fail = stable_setbatch(t, e, n);
+	// the tables set are owned by t, the guard keeps the ones not set (their entry is ST_NIL)
+	size_t k = 0, left = 0;
+	for (i=0;i<n && k<g->n;i++) {
+		if (e[i].v.p == g->t[k]) {
+			if (e[i].key.type == ST_NIL) {
+				g->t[left++] = g->t[k];
+			}
+			++k;
+		}
+	}
+	g->n = left;
+	if (fail == 0) {
+		lua_pop(L,2);
+		return;
+	}
+	// retry the numbers with the per key conversion, and report the others
+	for (i=0;i<n;i++) {
+		if (e[i].key.type != ST_NIL) {
+			continue;
+		}
+		if (e[i].key.key) {
+			lua_pushlstring(L, e[i].key.key, e[i].key.sz_idx);
+		} else {
+			lua_pushinteger(L, (lua_Integer)e[i].key.sz_idx + 1);
+		}
+		lua_rawget(L, index);
+		int type = lua_type(L,-1);
+		if (type != LUA_TNUMBER || _set_number(L, t, e[i].key.key, e[i].key.sz_idx, -1)) {
+			_error(L, e[i].key.key, e[i].key.sz_idx, type);
+		}
+		lua_pop(L,1);
+	}
+	lua_pop(L,2);
+}
+
 static void
 _set_value(lua_State *L, struct table * t, const char *key, size_t sz, int idx) {
 	int type = lua_type(L,idx);
-	int r;
+	int r = 0;
 	switch(type) {
 	case LUA_TNUMBER: 
-		r = stable_setnumber(t, key , sz , lua_tonumber(L,idx));
+		r = _set_number(L, t, key, sz, idx);
 		break;
 	case LUA_TBOOLEAN:
 		r = stable_setboolean(t, key, sz, lua_toboolean(L,idx));
@@ -113,6 +348,20 @@ _set_value(lua_State *L, struct table * t, const char *key, size_t sz, int idx)
 	case LUA_TLIGHTUSERDATA:
 		r = stable_setid(t, key, sz, (uint64_t)(uintptr_t)lua_touserdata(L,idx));
 		break;
+	case LUA_TTABLE: {
+		idx = lua_absindex(L, idx);
+		struct load_guard *g = _new_guard(L, 1);
+		struct table *sub = stable_create_child(t);
+		g->t[g->n++] = sub;
+		_load(L, sub, idx, 1);
+		r = stable_settable(t, key, sz, sub);
+		_guard_clear(g);
+		lua_pop(L,1);
+		if (r) {
+			stable_release(sub);
+		}
+		break;
+	}
 	default:
 		luaL_error(L,"Unsupport value type %s",lua_typename(L,type));
 	}
@@ -143,10 +392,10 @@ _set(lua_State *L) {
 
 static int
 _iter_stable_array(lua_State *L) {
-	int idx = luaL_checkinteger(L,2);
+	lua_Integer idx = luaL_checkinteger(L,2);
 	lua_pushinteger(L,idx+1);
 	union table_value v;
-	int t = stable_type(lua_touserdata(L,1), NULL, idx, &v);
+	int t = stable_type(lua_touserdata(L,1), NULL, (size_t)idx, &v);
 	if (t == ST_NIL) {
 		return 0;
 	}
@@ -163,76 +412,44 @@ _ipairs(lua_State *L) {
 }
 
 /*
-	uv1:  array_part
-	uv2:  hash_part
-	uv3:  position
-	uv4:  userdata: keys
+	uv1:  count
+	uv2:  position
+	uv3:  userdata: keys
 	lightuserdata: stable
-	string key
+	key
 
-	string nextkey
+	nextkey
 	value
- */
-
-static int
-_next_key(lua_State *L,struct table *t) {
-	int hash_part = lua_tointeger(L,lua_upvalueindex(2));
-	if (hash_part == 0)
-		return 0;
-	int position = lua_tointeger(L,lua_upvalueindex(3));
-	if (position >= hash_part) {
-		lua_pushinteger(L,0);
-		lua_replace(L,lua_upvalueindex(3));
-		return 0;
-	}
-	lua_pushinteger(L,position+1);
-	lua_replace(L,lua_upvalueindex(3));
-
-	struct table_key *keys = lua_touserdata(L,lua_upvalueindex(4));
-	lua_pushlstring(L,keys[position].key,keys[position].sz_idx);
-
-	union table_value tv;
-	int ttype = stable_type(t, keys[position].key,keys[position].sz_idx, &tv);
-	_getvalue(L, ttype, &tv);
 
-	return 2;
-}
+	Integer keys may be in both the array part and the hash part, so iterate
+	over the snapshot of keys by position and skip the ones removed since.
+ */
 
 static int
-_next_index(lua_State *L,struct table *t, int prev_index) {
-	int array_part = lua_tointeger(L,lua_upvalueindex(1));
-	if (prev_index >= array_part) {
-		return _next_key(L,t);
-	}
-	int i;
-	int ttype;
+_next_stable(lua_State *L) {
+	struct table *t = lua_touserdata(L,1);
+	int count = lua_tointeger(L,lua_upvalueindex(1));
+	int position = lua_isnil(L,2) ? 0 : lua_tointeger(L,lua_upvalueindex(2));
+	struct table_key *keys = lua_touserdata(L,lua_upvalueindex(3));
 	union table_value tv;
-	for (i=prev_index;i<array_part;i++) {
-		ttype = stable_type(t, NULL, i, &tv);
+	while (position < count) {
+		struct table_key *k = &keys[position++];
+		int ttype = stable_type(t, k->key, k->sz_idx, &tv);
 		if (ttype == ST_NIL)
 			continue;
-		lua_pushinteger(L,i+1);
+		lua_pushinteger(L,position);
+		lua_replace(L,lua_upvalueindex(2));
+		if (k->key) {
+			lua_pushlstring(L,k->key,k->sz_idx);
+		} else {
+			lua_pushinteger(L,(lua_Integer)k->sz_idx + 1);
+		}
 		_getvalue(L, ttype, &tv);
 		return 2;
 	}
-	return _next_key(L,t);
-}
-
-static int
-_next_stable(lua_State *L) {
-	struct table *t = lua_touserdata(L,1);
-	int type = lua_type(L,2);
-	switch(type) {
-	case LUA_TNIL:
-		return _next_index(L,t,0);
-		break;
-	case LUA_TNUMBER:
-		return _next_index(L,t,lua_tointeger(L,2));
-	case LUA_TSTRING:
-		return _next_key(L,t);
-	default:
-		return luaL_error(L, "Invalid next key");
-	}
+	lua_pushinteger(L,0);
+	lua_replace(L,lua_upvalueindex(2));
+	return 0;
 }
 
 static int
@@ -241,42 +458,106 @@ _pairs(lua_State *L) {
 	size_t cap = stable_cap(t);
 	struct table_key *keys = malloc(cap * sizeof(*keys));
 	int size = stable_keys(t,keys,cap);
-	if (size == 0) {
-		lua_pushinteger(L,0);
-		lua_pushinteger(L,0);
-		lua_pushinteger(L,0);
-		lua_pushnil(L);
+	lua_pushinteger(L,size);
+	lua_pushinteger(L,0);
+	if (size > 0) {
+		void * ud = lua_newuserdata(L, size * sizeof(struct table_key));
+		memcpy(ud, keys, size * sizeof(struct table_key));
 	} else {
-		int array_part = 0;
-		int hash_part = 0;
-		int i=0;
-		for (i=0;i<size;i++) {
-			struct table_key *key = &keys[i];
-			if (key->key)
-				break;
-		}
-		if (i==0) {
-			hash_part = size;
-		} else {
-			array_part = keys[i-1].sz_idx + 1;
-			hash_part = size - i;
-		}
-		lua_pushinteger(L,array_part);
-		lua_pushinteger(L,hash_part);
-		lua_pushinteger(L,0);
-		if (hash_part > 0) {
-			void * ud = lua_newuserdata(L, hash_part * sizeof(struct table_key));
-			memcpy(ud, keys + i, hash_part * sizeof(struct table_key));
-		} else {
-			lua_pushnil(L);
-		}
+		lua_pushnil(L);
 	}
-	lua_pushcclosure(L,_next_stable,4);
+	lua_pushcclosure(L,_next_stable,3);
 	free(keys);
 	lua_pushvalue(L,1);
 	return 2;
 }
 
+/*
+	sraw.totable(t [, depth]) copies t into a lua table, nested tables are
+	copied until depth (default MAX_DEPTH) and left as lightuserdata below.
+ */
+
+struct export_ud {
+	lua_State *L;
+	int depth;
+	int error;
+	const struct table_key *key;
+	union table_value *v;
+};
+
+static void _export_table(lua_State *L, struct table *t, int depth);
+
+// _export_entry(table, export_ud) sets one entry, called by lua_pcall
+static int
+_export_entry(lua_State *L) {
+	struct export_ud *e = lua_touserdata(L,2);
+	const struct table_key *key = e->key;
+	if (key->key) {
+		lua_pushlstring(L, key->key, key->sz_idx);
+	} else {
+		lua_pushinteger(L, (lua_Integer)key->sz_idx + 1);
+	}
+	if (key->type == ST_TABLE && e->depth > 1) {
+		_export_table(L, e->v->p, e->depth - 1);
+	} else {
+		_getvalue(L, key->type, e->v);
+	}
+	lua_rawset(L, 1);
+	return 0;
+}
+
+/*
+	A lua error (out of memory) must not jump out of stable_foreach, which
+	pins the map and the array, so each entry is set in a protected call,
+	and the first error is raised again after stable_foreach returns.
+ */
+static void
+_export_value(void *ud, const struct table_key *key, union table_value *v) {
+	struct export_ud *e = ud;
+	lua_State *L = e->L;
+	if (e->error) {
+		return;
+	}
+	e->key = key;
+	e->v = v;
+	lua_pushvalue(L, -1);	// _export_entry
+	lua_pushvalue(L, -3);	// the table
+	lua_pushlightuserdata(L, e);
+	if (lua_pcall(L, 2, 0, 0) != 0) {
+		// keep the error object at the top
+		e->error = 1;
+	}
+}
+
+static void
+_export_table(lua_State *L, struct table *t, int depth) {
+	size_t narr, nrec;
+	stable_size(t, &narr, &nrec);
+	luaL_checkstack(L, 6, NULL);
+	lua_createtable(L, (int)narr, (int)nrec);
+	lua_pushcfunction(L, _export_entry);
+	struct export_ud e = { L, depth, 0, NULL, NULL };
+	stable_foreach(t, _export_value, &e);
+	if (e.error) {
+		lua_error(L);
+	}
+	lua_pop(L,1);
+}
+
+static int
+_totable(lua_State *L) {
+	struct table *t = lua_touserdata(L,1);
+	int depth = luaL_optinteger(L,2,MAX_DEPTH);
+	if (t == NULL) {
+		return luaL_error(L, "Need a stable table");
+	}
+	if (depth < 1) {
+		return luaL_error(L, "Invalid depth %d", depth);
+	}
+	_export_table(L, t, depth);
+	return 1;
+}
+
 static int
 _init_mt(lua_State *L) {
 	lua_pushlightuserdata(L,NULL);
@@ -298,13 +579,619 @@ _init_mt(lua_State *L) {
 	return 0;
 }
 
+// sraw.create([parent]) or sraw.create(luatable [, parent])
 static int
 _create(lua_State *L) {
-	struct table * t = stable_create(L);
+	struct table * t;
+	int parent = lua_istable(L,1) ? 2 : 1;
+	if (lua_type(L,parent) == LUA_TLIGHTUSERDATA) {
+		// share the allocator and the accounting of the parent
+		t = stable_create_child(lua_touserdata(L,parent));
+	} else {
+		t = stable_create();
+	}
+	if (parent == 2) {
+		struct load_guard *g = _new_guard(L, 1);
+		g->t[g->n++] = t;
+		_load(L, t, 1, 0);
+		_guard_clear(g);
+	}
 	lua_pushlightuserdata(L,t);
 	return 1;
 }
 
+// keys at [from, to] of the stack, the strings stay on the stack
+static int
+_get_path(lua_State *L, int from, int to, struct table_key *path) {
+	int n = to - from + 1;
+	if (n > MAX_DEPTH) {
+		luaL_error(L, "Path is too long (%d)", n);
+	}
+	int i;
+	for (i=0;i<n;i++) {
+		path[i].type = ST_NIL;
+		path[i].key = _get_key(L, from + i, &path[i].sz_idx);
+	}
+	return n;
+}
+
+// sraw.getpath(t, k1, k2, ...) is t[k1][k2]... in one call, nil if a step is missing
+static int
+_getpath(lua_State *L) {
+	struct table * t = lua_touserdata(L,1);
+	struct table_key path[MAX_DEPTH];
+	int n = _get_path(L, 2, lua_gettop(L), path);
+	if (n == 0) {
+		return luaL_error(L, "Need a path");
+	}
+	union table_value tv;
+	int ttype = stable_getpath(t, path, n, &tv);
+	_getvalue(L, ttype, &tv);
+	return 1;
+}
+
+// sraw.setpath(t, k1, k2, ..., v) sets t[k1][k2]... = v, the tables on the path must exist
+static int
+_setpath(lua_State *L) {
+	struct table * t = lua_touserdata(L,1);
+	struct table_key path[MAX_DEPTH];
+	int top = lua_gettop(L);
+	if (top < 3) {
+		return luaL_error(L, "Need a path and a value");
+	}
+	int n = _get_path(L, 2, top - 1, path);
+	struct table * sub = stable_path(t, path, n - 1);
+	if (sub == NULL) {
+		return luaL_error(L, "Path not found");
+	}
+	_set_value(L, sub, path[n-1].key, path[n-1].sz_idx, top);
+	return 0;
+}
+
+/*
+	Number kernels : the range [i, j] (1 based) is at index from, default is
+	all the positive integer keys (the sparse ones in the map are collected,
+	not searched one by one).
+ */
+static void
+_get_range(lua_State *L, int from, size_t *begin, size_t *end) {
+	lua_Integer i = luaL_optinteger(L, from, 1);
+	lua_Integer j = luaL_optinteger(L, from + 1, LUA_MAXINTEGER);
+	if (i < 1) {
+		i = 1;
+	}
+	if (j < i) {
+		j = i - 1;
+	}
+	*begin = (size_t)(i - 1);
+	*end = (size_t)j;
+}
+
+static int
+_get_op(lua_State *L, int index) {
+	static const char *const ops[] = { "<", "<=", "==", "~=", ">=", ">", NULL };
+	static const int op_id[] = { ST_LT, ST_LE, ST_EQ, ST_NE, ST_GE, ST_GT };
+	return op_id[luaL_checkoption(L, index, NULL, ops)];
+}
+
+// sraw.sum(t [, i, j]) returns the sum and the count of numbers
+static int
+_sum(lua_State *L) {
+	struct table * t = lua_touserdata(L,1);
+	size_t from, to, count;
+	_get_range(L, 2, &from, &to);
+	lua_pushnumber(L, stable_sum(t, from, to, &count));
+	lua_pushinteger(L, (lua_Integer)count);
+	return 2;
+}
+
+// sraw.minmax(t [, i, j]) returns min and max, or nothing
+static int
+_minmax_range(lua_State *L) {
+	struct table * t = lua_touserdata(L,1);
+	size_t from, to;
+	double min, max;
+	_get_range(L, 2, &from, &to);
+	if (!stable_minmax(t, from, to, &min, &max)) {
+		return 0;
+	}
+	lua_pushnumber(L, min);
+	lua_pushnumber(L, max);
+	return 2;
+}
+
+// sraw.count(t, op, v [, i, j]), op is "<", "<=", "==", "~=", ">=" or ">"
+static int
+_count(lua_State *L) {
+	struct table * t = lua_touserdata(L,1);
+	int op = _get_op(L, 2);
+	double v = luaL_checknumber(L, 3);
+	size_t from, to;
+	_get_range(L, 4, &from, &to);
+	lua_pushinteger(L, (lua_Integer)stable_count_if(t, from, to, op, v));
+	return 1;
+}
+
+// sraw.findfirst(t, op, v [, i, j]) returns the first index matching, or nothing
+static int
+_findfirst(lua_State *L) {
+	struct table * t = lua_touserdata(L,1);
+	int op = _get_op(L, 2);
+	double v = luaL_checknumber(L, 3);
+	size_t from, to, idx;
+	_get_range(L, 4, &from, &to);
+	if (!stable_find_first(t, from, to, op, v, &idx)) {
+		return 0;
+	}
+	lua_pushinteger(L, (lua_Integer)idx + 1);
+	return 1;
+}
+
+// sraw.add(t, key, delta) returns the new value, atomic with other writers
+static int
+_add(lua_State *L) {
+	struct table * t = lua_touserdata(L,1);
+	size_t sz;
+	const char * key = _get_key(L,2,&sz);
+	int r;
+#if LUA_VERSION_NUM >= 503
+	if (lua_isinteger(L,3)) {
+		int64_t result;
+		lua_Integer delta = lua_tointeger(L,3);
+		if (stable_addinteger(t, key, sz, delta, &result) == 0) {
+			lua_pushinteger(L, result);
+			return 1;
+		}
+	}
+#endif
+	double result;
+	r = stable_addnumber(t, key, sz, luaL_checknumber(L,3), &result);
+	if (r) {
+		_error(L,key,sz,LUA_TNUMBER);
+	}
+	lua_pushnumber(L, result);
+	return 1;
+}
+
+// sraw.post(t, key, value) queues a write without waiting for the table lock, returns a ticket for sraw.sync
+static int
+_post(lua_State *L) {
+	struct table * t = lua_touserdata(L,1);
+	struct table_entry e;
+	e.key.key = _get_key(L,2,&e.key.sz_idx);
+	int type = lua_type(L,3);
+	switch (type) {
+	case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+		if (lua_isinteger(L,3)) {
+			e.key.type = ST_INTEGER;
+			e.v.i = lua_tointeger(L,3);
+			break;
+		}
+#endif
+		e.key.type = ST_NUMBER;
+		e.v.n = lua_tonumber(L,3);
+		break;
+	case LUA_TBOOLEAN:
+		e.key.type = ST_BOOLEAN;
+		e.v.b = lua_toboolean(L,3);
+		break;
+	case LUA_TSTRING:
+		e.key.type = ST_STRING;
+		e.v.p = (void *)lua_tolstring(L,3,&e.sz);
+		break;
+	case LUA_TLIGHTUSERDATA:
+		e.key.type = ST_ID;
+		e.v.id = (uint64_t)(uintptr_t)lua_touserdata(L,3);
+		break;
+	default:
+		return luaL_error(L,"Unsupport value type %s",lua_typename(L,type));
+	}
+	lua_pushnumber(L, (lua_Number)stable_post(t, &e));
+	return 1;
+}
+
+// sraw.sync(t [, ticket]) waits until the writes posted before ticket (or all of them) are set
+static int
+_sync(lua_State *L) {
+	luaL_checktype(L,1,LUA_TLIGHTUSERDATA);
+	stable_sync(lua_touserdata(L,1), (uint64_t)luaL_optnumber(L,2,0));
+	return 0;
+}
+
+static int
+_minmax(lua_State *L, int max) {
+	struct table * t = lua_touserdata(L,1);
+	size_t sz;
+	const char * key = _get_key(L,2,&sz);
+	double v = luaL_checknumber(L,3);
+	double result;
+	int r = max ? stable_maxnumber(t, key, sz, v, &result) : stable_minnumber(t, key, sz, v, &result);
+	if (r) {
+		_error(L,key,sz,LUA_TNUMBER);
+	}
+	lua_pushnumber(L, result);
+	return 1;
+}
+
+static int
+_min(lua_State *L) {
+	return _minmax(L, 0);
+}
+
+static int
+_max(lua_State *L) {
+	return _minmax(L, 1);
+}
+
+// sraw.reclaim(true) starts the reclaimer thread, sraw.reclaim(false) stops it
+static int
+_reclaim(lua_State *L) {
+	if (lua_toboolean(L,1)) {
+		stable_reclaim_start();
+	} else {
+		stable_reclaim_stop();
+	}
+	return 0;
+}
+
+// sraw.cache(true|false) enables the read cache of the calling thread,
+// sraw.cache() returns its hit and miss counts
+static int
+_cache(lua_State *L) {
+	if (lua_isnoneornil(L,1)) {
+		uint64_t hit, miss;
+		stable_cache_stats(&hit, &miss);
+		lua_pushnumber(L, (lua_Number)hit);
+		lua_pushnumber(L, (lua_Number)miss);
+		return 2;
+	}
+	stable_cache_enable(lua_toboolean(L,1));
+	return 0;
+}
+
+// sraw.collect() collects cycles and returns the number of tables freed,
+// sraw.collect(true) starts recording candidates, sraw.collect(false) stops it
+static int
+_collect(lua_State *L) {
+	if (lua_isnoneornil(L,1)) {
+		lua_pushinteger(L, stable_collect());
+		return 1;
+	}
+	if (lua_toboolean(L,1)) {
+		stable_collect_start();
+		return 0;
+	}
+	lua_pushinteger(L, stable_collect_stop());
+	return 1;
+}
+
+// sraw.sharded(n [, parent]) creates a table with n write locks, see stable_create_sharded
+static int
+_sharded(lua_State *L) {
+	int n = luaL_checkinteger(L,1);
+	struct table *parent = lua_touserdata(L,2);
+	lua_pushlightuserdata(L, stable_create_sharded(parent, n));
+	return 1;
+}
+
+// sraw.detached([parent]) creates a table to build without lock, see stable_create_detached
+static int
+_detached(lua_State *L) {
+	struct table *parent = lua_touserdata(L,1);
+	lua_pushlightuserdata(L, stable_create_detached(parent));
+	return 1;
+}
+
+// sraw.swap(parent, key, t) attaches t and returns the replaced table (or nil)
+static int
+_swap(lua_State *L) {
+	luaL_checktype(L,1,LUA_TLIGHTUSERDATA);
+	luaL_checktype(L,3,LUA_TLIGHTUSERDATA);
+	struct table *parent = lua_touserdata(L,1);
+	size_t sz;
+	const char * key = _get_key(L,2,&sz);
+	struct table *old;
+	if (stable_swap_table(parent, key, sz, lua_touserdata(L,3), &old)) {
+		_error(L,key,sz,LUA_TLIGHTUSERDATA);
+	}
+	if (old == NULL) {
+		return 0;
+	}
+	lua_pushlightuserdata(L, old);
+	return 1;
+}
+
+// sraw.load(t, luatable) copies luatable into t
+static int
+_loadtable(lua_State *L) {
+	luaL_checktype(L,1,LUA_TLIGHTUSERDATA);
+	luaL_checktype(L,2,LUA_TTABLE);
+	_load(L, lua_touserdata(L,1), 2, 0);
+	return 0;
+}
+
+/*
+	Prototypes of the schema layer (stable.lua), built once by stable.init.
+	A struct prototype holds the default of each field, a table for a nested
+	struct or array. An array prototype is { s = 0 [, i = {}] } with p, the
+	prototype of its elements, or d, their default value. p and d describe
+	the elements and are not copied. Prototypes are never written after
+	they are built, so the keys and strings of a snapshot stay valid.
+ */
+
+struct proto_copy {
+	struct table_entry *e;
+	size_t n;
+	size_t cap;
+};
+
+static void
+_copy_string(void *ud, const char *str, size_t sz) {
+	struct table_entry *e = ud;
+	char *s = malloc(sz + 1);
+	memcpy(s, str, sz);
+	s[sz] = '\0';
+	e->v.p = s;
+	e->sz = sz;
+}
+
+static void
+_proto_entry(void *ud, const struct table_key *key, union table_value *v) {
+	struct proto_copy *c = ud;
+	if (key->key && key->sz_idx == 1 && (key->key[0] == 'p' || key->key[0] == 'd')) {
+		return;
+	}
+	if (c->n >= c->cap) {
+		c->cap = c->cap ? c->cap * 2 : 16;
+		c->e = realloc(c->e, c->cap * sizeof(struct table_entry));
+	}
+	struct table_entry *e = &c->e[c->n++];
+	e->key = *key;
+	e->sz = 0;
+	if (key->type == ST_STRING) {
+		stable_value_string(v, _copy_string, e);
+	} else {
+		e->v = *v;
+	}
+}
+
+static void
+_proto_free(struct proto_copy *c) {
+	size_t i;
+	for (i=0;i<c->n;i++) {
+		if (c->e[i].key.type == ST_STRING) {
+			free(c->e[i].v.p);
+		}
+	}
+	free(c->e);
+}
+
+// A deep copy of proto, sharing the accounting of parent (a new tree if parent is NULL)
+static struct table *
+_clone(struct table *parent, struct table *proto) {
+	struct table *t = parent ? stable_create_child(parent) : stable_create();
+	struct proto_copy c = { NULL, 0, 0 };
+	stable_foreach(proto, _proto_entry, &c);
+	size_t i;
+	for (i=0;i<c.n;i++) {
+		if (c.e[i].key.type == ST_TABLE) {
+			c.e[i].v.p = _clone(t, c.e[i].v.p);
+		}
+	}
+	stable_setbatch(t, c.e, c.n);
+	_proto_free(&c);
+	return t;
+}
+
+static size_t
+_array_len(struct table *t) {
+	union table_value v;
+	switch (stable_type(t, "s", 1, &v)) {
+	case ST_NUMBER:
+		return (size_t)v.n;
+	case ST_INTEGER:
+		return (size_t)v.i;
+	}
+	return 0;
+}
+
+static void
+_set_len(struct table *t, size_t n) {
+	if (stable_setinteger(t, "s", 1, (int64_t)n)) {
+		stable_setnumber(t, "s", 1, (double)n);
+	}
+}
+
+static void _resize(struct table *arr, struct table *proto, size_t size);
+
+// Set the values of t back to proto, in place, so the objects bound to t stay valid.
+static void
+_reset(struct table *t, struct table *proto) {
+	struct table *elem = stable_table(proto, "p", 1);
+	if (elem || stable_type(proto, "d", 1, NULL) != ST_NIL) {
+		_resize(t, proto, 0);
+		return;
+	}
+	struct proto_copy c = { NULL, 0, 0 };
+	stable_foreach(proto, _proto_entry, &c);
+	size_t i;
+	for (i=0;i<c.n;i++) {
+		struct table_entry *e = &c.e[i];
+		if (e->key.type == ST_TABLE) {
+			struct table *sub = stable_table(t, e->key.key, e->key.sz_idx);
+			if (sub) {
+				_reset(sub, e->v.p);
+				e->key.type = ST_NIL;
+			} else {
+				e->v.p = _clone(t, e->v.p);
+			}
+		}
+	}
+	stable_setbatch(t, c.e, c.n);
+	_proto_free(&c);
+}
+
+/*
+	Resize an array of the schema layer. New elements are cloned from the
+	element prototype and set with one stable_setbatch, elements kept from a
+	previous shrink are reused (they were reset). Removed elements are reset.
+ */
+static void
+_resize(struct table *arr, struct table *proto, size_t size) {
+	size_t n = _array_len(arr);
+	struct table *elem = stable_table(proto, "p", 1);
+	struct table_entry d;
+	d.key.type = stable_type(proto, "d", 1, &d.v);
+	d.sz = 0;
+	if (d.key.type == ST_STRING) {
+		stable_value_string(&d.v, _copy_string, &d);
+	}
+	size_t from = size > n ? n : size;
+	size_t to = size > n ? size : n;
+	size_t i;
+	if (elem == NULL || size > n) {
+		struct table_entry *e = malloc((to - from) * sizeof(*e) + 1);
+		size_t count = 0;
+		for (i=from;i<to;i++) {
+			if (elem) {
+				if (stable_table(arr, NULL, i)) {
+					continue;
+				}
+				e[count].key.type = ST_TABLE;
+				e[count].v.p = _clone(arr, elem);
+			} else {
+				e[count] = d;
+			}
+			e[count].key.key = NULL;
+			e[count].key.sz_idx = i;
+			++count;
+		}
+		stable_setbatch(arr, e, count);
+		free(e);
+	} else {
+		for (i=from;i<to;i++) {
+			struct table *sub = stable_table(arr, NULL, i);
+			if (sub) {
+				_reset(sub, elem);
+			}
+		}
+	}
+	if (d.key.type == ST_STRING) {
+		free(d.v.p);
+	}
+	_set_len(arr, size);
+}
+
+// sraw.clone(proto [, parent]) returns a deep copy of a prototype
+static int
+_clonetable(lua_State *L) {
+	luaL_checktype(L,1,LUA_TLIGHTUSERDATA);
+	lua_pushlightuserdata(L, _clone(lua_touserdata(L,2), lua_touserdata(L,1)));
+	return 1;
+}
+
+// sraw.resize(arr, proto, size) resizes an array with the prototype of the array
+static int
+_resizearray(lua_State *L) {
+	luaL_checktype(L,1,LUA_TLIGHTUSERDATA);
+	luaL_checktype(L,2,LUA_TLIGHTUSERDATA);
+	lua_Integer size = luaL_checkinteger(L,3);
+	if (size < 0) {
+		return luaL_error(L, "Invalid size %d", (int)size);
+	}
+	_resize(lua_touserdata(L,1), lua_touserdata(L,2), (size_t)size);
+	return 0;
+}
+
+// the encoder pins the tables it reads, so it writes into a C buffer, not a luaL_Buffer that may raise an error
+struct encode_buffer {
+	char *p;
+	size_t sz;
+	size_t cap;
+	int oom;
+};
+
+static void
+_write_buffer(void *ud, const char *str, size_t sz) {
+	struct encode_buffer *b = ud;
+	if (b->oom) {
+		return;
+	}
+	if (b->sz + sz > b->cap) {
+		size_t cap = b->cap ? b->cap * 2 : 256;
+		while (cap < b->sz + sz) {
+			cap *= 2;
+		}
+		char *p = realloc(b->p, cap);
+		if (p == NULL) {
+			b->oom = 1;
+			return;
+		}
+		b->p = p;
+		b->cap = cap;
+	}
+	memcpy(b->p + b->sz, str, sz);
+	b->sz += sz;
+}
+
+// sraw.encode(t) returns t as a MessagePack string
+static int
+_encode(lua_State *L) {
+	luaL_checktype(L,1,LUA_TLIGHTUSERDATA);
+	struct encode_buffer b = { NULL, 0, 0, 0 };
+	int r = stable_encode_msgpack(lua_touserdata(L,1), _write_buffer, &b);
+	if (r || b.oom) {
+		free(b.p);
+		return luaL_error(L, r ? "Table is too deep" : "Not enough memory");
+	}
+	// push it in a protected call, so the buffer is freed on error
+	struct string_push p;
+	p.str = b.p ? b.p : "";
+	p.sz = b.sz;
+	lua_pushcfunction(L, _push_string);
+	lua_pushlightuserdata(L, &p);
+	int status = lua_pcall(L, 1, 1, 0);
+	free(b.p);
+	if (status != 0) {
+		return lua_error(L);
+	}
+	return 1;
+}
+
+// sraw.decode(str [, parent]) builds a table from a MessagePack string
+static int
+_decode(lua_State *L) {
+	size_t sz;
+	const char *buf = luaL_checklstring(L,1,&sz);
+	struct table *t = stable_decode_msgpack(lua_touserdata(L,2), buf, sz, NULL);
+	if (t == NULL) {
+		return luaL_error(L, "Invalid MessagePack data");
+	}
+	lua_pushlightuserdata(L, t);
+	return 1;
+}
+
+// sraw.freeze(t) makes the tree immutable, before it's shared
+static int
+_freeze(lua_State *L) {
+	luaL_checktype(L,1,LUA_TLIGHTUSERDATA);
+	if (stable_freeze(lua_touserdata(L,1))) {
+		return luaL_error(L, "Can't freeze the table");
+	}
+	return 0;
+}
+
+static int
+_memory(lua_State *L) {
+	luaL_checktype(L,1,LUA_TLIGHTUSERDATA);
+	struct stable_memory m;
+	stable_memory(lua_touserdata(L,1), &m);
+	lua_pushnumber(L,(lua_Number)m.total);
+	lua_pushnumber(L,(lua_Number)m.retired);
+	return 2;
+}
+
 static int
 _release(lua_State *L) {
 	struct table ** t = lua_touserdata(L,1);
@@ -346,6 +1233,285 @@ _incref(lua_State *L) {
 	return 0;
 }
 
+/*
+	A view is a full userdata pinning a string slot, so large values can be
+	inspected without creating a lua string. It keeps a reference to the table
+	because the slot must be released before the table.
+ */
+
+struct string_view {
+	struct table_string s;
+	struct table *t;
+};
+
+static int
+_view_gc(lua_State *L) {
+	struct string_view *v = lua_touserdata(L,1);
+	if (v->t) {
+		stable_string_release(&v->s);
+		stable_release(v->t);
+		v->t = NULL;
+	}
+	return 0;
+}
+
+// sraw.view(t, key) returns nil if the value is not a string
+static int
+_view(lua_State *L) {
+	luaL_checktype(L,1,LUA_TLIGHTUSERDATA);
+	struct table * t = lua_touserdata(L,1);
+	size_t sz;
+	const char * key = _get_key(L,2,&sz);
+	struct string_view *v = lua_newuserdata(L, sizeof(*v));
+	v->t = NULL;
+	lua_pushvalue(L,lua_upvalueindex(1));
+	lua_setmetatable(L,-2);
+	if (!stable_string_view(t, key, sz, &v->s)) {
+		return 0;
+	}
+	stable_grab(t);
+	v->t = t;
+	return 1;
+}
+
+static struct table_string *
+_check_view(lua_State *L) {
+	struct string_view *v = luaL_checkudata(L,1,"stable.view");
+	if (v->t == NULL) {
+		luaL_error(L,"Released string view");
+	}
+	return &v->s;
+}
+
+static size_t
+_view_pos(lua_Integer pos, size_t len) {
+	if (pos >= 0) {
+		return (size_t)pos;
+	} else if ((size_t)-pos > len) {
+		return 0;
+	}
+	return len + (size_t)pos + 1;
+}
+
+static int
+_view_len(lua_State *L) {
+	struct table_string *s = _check_view(L);
+	lua_pushinteger(L,s->sz);
+	return 1;
+}
+
+static int
+_view_tostring(lua_State *L) {
+	struct table_string *s = _check_view(L);
+	lua_pushlstring(L,s->str,s->sz);
+	return 1;
+}
+
+static int
+_view_sub(lua_State *L) {
+	struct table_string *s = _check_view(L);
+	size_t i = _view_pos(luaL_optinteger(L,2,1), s->sz);
+	size_t j = _view_pos(luaL_optinteger(L,3,-1), s->sz);
+	if (i < 1) {
+		i = 1;
+	}
+	if (j > s->sz) {
+		j = s->sz;
+	}
+	if (i > j) {
+		lua_pushliteral(L,"");
+	} else {
+		lua_pushlstring(L,s->str + i - 1,j - i + 1);
+	}
+	return 1;
+}
+
+static int
+_view_byte(lua_State *L) {
+	struct table_string *s = _check_view(L);
+	lua_Integer pi = luaL_optinteger(L,2,1);
+	size_t i = _view_pos(pi, s->sz);
+	size_t j = _view_pos(luaL_optinteger(L,3,pi), s->sz);
+	if (i < 1) {
+		i = 1;
+	}
+	if (j > s->sz) {
+		j = s->sz;
+	}
+	if (i > j) {
+		return 0;
+	}
+	int n = (int)(j - i + 1);
+	luaL_checkstack(L,n,"string slice too long");
+	size_t k;
+	for (k=i;k<=j;k++) {
+		lua_pushinteger(L,(unsigned char)s->str[k-1]);
+	}
+	return n;
+}
+
+static void
+_view_metatable(lua_State *L) {
+	luaL_Reg m[] = {
+		{ "len", _view_len },
+		{ "tostring", _view_tostring },
+		{ "sub", _view_sub },
+		{ "byte", _view_byte },
+		{ NULL, NULL },
+	};
+	luaL_newmetatable(L,"stable.view");
+	luaL_newlib(L,m);
+	lua_setfield(L,-2,"__index");
+	lua_pushcfunction(L,_view_len);
+	lua_setfield(L,-2,"__len");
+	lua_pushcfunction(L,_view_tostring);
+	lua_setfield(L,-2,"__tostring");
+	lua_pushcfunction(L,_view_gc);
+	lua_setfield(L,-2,"__gc");
+}
+
+/*
+	A channel object is a full userdata holding a reference of a channel.
+	send grabs a reference for the channel, and recv returns the handle with
+	an object holding the reference received (like sraw.grab), so a handle
+	in flight is never freed.
+ */
+
+static struct stable_channel *
+_check_channel(lua_State *L) {
+	return *(struct stable_channel **)luaL_checkudata(L,1,"stable.channel");
+}
+
+static int
+_channel_gc(lua_State *L) {
+	struct stable_channel **c = luaL_checkudata(L,1,"stable.channel");
+	if (*c) {
+		stable_channel_release(*c);
+		*c = NULL;
+	}
+	return 0;
+}
+
+// ch:send(t [, block]) returns false if the channel is full and block is false
+static int
+_channel_send(lua_State *L) {
+	struct stable_channel *c = _check_channel(L);
+	luaL_checktype(L,2,LUA_TLIGHTUSERDATA);
+	struct table *t = lua_touserdata(L,2);
+	int block = lua_isnoneornil(L,3) || lua_toboolean(L,3);
+	stable_grab(t);
+	if (stable_channel_send(c, t, block)) {
+		stable_release(t);
+		lua_pushboolean(L,0);
+	} else {
+		lua_pushboolean(L,1);
+	}
+	return 1;
+}
+
+// ch:recv([block]) returns the handle and its reference, or nil if the channel is empty and block is false
+static int
+_channel_recv(lua_State *L) {
+	struct stable_channel *c = _check_channel(L);
+	int block = lua_isnoneornil(L,2) || lua_toboolean(L,2);
+	struct table *t = stable_channel_recv(c, block);
+	if (t == NULL) {
+		return 0;
+	}
+	lua_pushlightuserdata(L,t);
+	struct table ** ud = lua_newuserdata(L, sizeof(struct table *));
+	*ud = t;
+	lua_pushvalue(L,lua_upvalueindex(1));
+	lua_setmetatable(L,-2);
+	return 2;
+}
+
+// ch:handle() returns a lightuserdata for sraw.channel in another lua state
+static int
+_channel_handle(lua_State *L) {
+	lua_pushlightuserdata(L, _check_channel(L));
+	return 1;
+}
+
+// sraw.channel([cap]) creates a channel, sraw.channel(handle) opens the channel of ch:handle()
+static int
+_channel(lua_State *L) {
+	struct stable_channel *c;
+	if (lua_type(L,1) == LUA_TLIGHTUSERDATA) {
+		c = lua_touserdata(L,1);
+		stable_channel_grab(c);
+	} else {
+		c = stable_channel_create((size_t)luaL_optinteger(L,1,64));
+	}
+	struct stable_channel **ud = lua_newuserdata(L, sizeof(*ud));
+	*ud = c;
+	luaL_setmetatable(L,"stable.channel");
+	return 1;
+}
+
+// the reference metatable is at the top
+static void
+_channel_metatable(lua_State *L) {
+	luaL_Reg m[] = {
+		{ "send", _channel_send },
+		{ "recv", _channel_recv },
+		{ "handle", _channel_handle },
+		{ NULL, NULL },
+	};
+	luaL_newmetatable(L,"stable.channel");
+	luaL_newlibtable(L,m);
+	lua_pushvalue(L,-3);
+	luaL_setfuncs(L,m,1);
+	lua_setfield(L,-2,"__index");
+	lua_pushcfunction(L,_channel_gc);
+	lua_setfield(L,-2,"__gc");
+	lua_pop(L,1);
+}
+
+static int
+_stats(lua_State *L) {
+	struct stable_stats st;
+	if (!stable_stats(&st)) {
+		return 0;
+	}
+	lua_createtable(L,0,17);
+	lua_pushnumber(L,(lua_Number)st.map_retry);
+	lua_setfield(L,-2,"map_retry");
+	lua_pushnumber(L,(lua_Number)st.array_retry);
+	lua_setfield(L,-2,"array_retry");
+	lua_pushnumber(L,(lua_Number)st.lock_spin);
+	lua_setfield(L,-2,"lock_spin");
+	lua_pushnumber(L,(lua_Number)st.grab_spin);
+	lua_setfield(L,-2,"grab_spin");
+	lua_pushnumber(L,(lua_Number)st.hash_expand);
+	lua_setfield(L,-2,"hash_expand");
+	lua_pushnumber(L,(lua_Number)st.array_expand);
+	lua_setfield(L,-2,"array_expand");
+	lua_pushnumber(L,(lua_Number)st.lookup);
+	lua_setfield(L,-2,"lookup");
+	lua_pushnumber(L,st.lookup ? (lua_Number)st.probe / st.lookup : 0);
+	lua_setfield(L,-2,"probe_avg");
+	lua_pushnumber(L,(lua_Number)st.probe_max);
+	lua_setfield(L,-2,"probe_max");
+	lua_pushnumber(L,(lua_Number)st.map_live);
+	lua_setfield(L,-2,"map_live");
+	lua_pushnumber(L,(lua_Number)st.array_live);
+	lua_setfield(L,-2,"array_live");
+	lua_pushnumber(L,(lua_Number)st.gc_run);
+	lua_setfield(L,-2,"gc_run");
+	lua_pushnumber(L,(lua_Number)st.gc_scan);
+	lua_setfield(L,-2,"gc_scan");
+	lua_pushnumber(L,(lua_Number)st.gc_collect);
+	lua_setfield(L,-2,"gc_collect");
+	lua_pushnumber(L,(lua_Number)st.post_batch);
+	lua_setfield(L,-2,"post_batch");
+	lua_pushnumber(L,(lua_Number)st.post_coalesce);
+	lua_setfield(L,-2,"post_coalesce");
+	lua_pushnumber(L,(lua_Number)st.string_inplace);
+	lua_setfield(L,-2,"string_inplace");
+	return 1;
+}
+
 int
 luaopen_stable_raw(lua_State *L) {
 	luaL_checkversion(L);
@@ -360,17 +1526,55 @@ luaopen_stable_raw(lua_State *L) {
 		{ "settable", _settable },
 		{ "pairs", _pairs },
 		{ "ipairs", _ipairs },
+		{ "totable", _totable },
+		{ "load", _loadtable },
+		{ "clone", _clonetable },
+		{ "encode", _encode },
+		{ "decode", _decode },
+		{ "freeze", _freeze },
+		{ "resize", _resizearray },
+		{ "sharded", _sharded },
+		{ "reclaim", _reclaim },
+		{ "collect", _collect },
+		{ "cache", _cache },
+		{ "getpath", _getpath },
+		{ "setpath", _setpath },
+		{ "add", _add },
+		{ "post", _post },
+		{ "sync", _sync },
+		{ "sum", _sum },
+		{ "minmax", _minmax_range },
+		{ "count", _count },
+		{ "findfirst", _findfirst },
+		{ "min", _min },
+		{ "max", _max },
+		{ "detached", _detached },
+		{ "swap", _swap },
 		{ "init", _init_mt },
+		{ "stats", _stats },
+		{ "memory", _memory },
 		{ NULL, NULL },
 	};
 
+	luaL_newmetatable(L,"stable.load");
+	lua_pushcfunction(L,_guard_gc);
+	lua_setfield(L,-2,"__gc");
+	lua_pop(L,1);
+
 	luaL_newlib(L,l);
 
 	lua_createtable(L,0,1);
 	lua_pushcfunction(L, _release);
 	lua_setfield(L, -2, "__gc"); 
+	_channel_metatable(L);
 	lua_pushcclosure(L, _grab, 1);
 	lua_setfield(L, -2, "grab");
+	lua_pushcfunction(L, _channel);
+	lua_setfield(L, -2, "channel");
+
+	_view_metatable(L);
+	lua_pushcclosure(L, _view, 1);
+	lua_setfield(L, -2, "view");
 
 	return 1;
 }
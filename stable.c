@@ -6,39 +6,142 @@
 #include <string.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#ifdef __linux__
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 
 #define DEFAULT_SIZE 4
 #define MAX_HASH_DEPTH 3
 #define MAGIC_NUMBER 0x5437ab1e
+#define MAX_ARRAY_SIZE 0x40000000
+#define ARRAY_BITS 31	// log2 buckets of the keys below MAX_ARRAY_SIZE
+#define ARRAY_CHUNK_BITS 10
+#define ARRAY_CHUNK (1<<ARRAY_CHUNK_BITS)
+#define MAX_SHARD_BITS 8
+#define SHORT_STRING 14
+#define SHORT_TAG 15
+#define STRING_INPLACE 64
+#define SCAN_BLOCK 256
+#define RECLAIM_BATCH 64
+#define CACHE_SIZE 256
+#define CACHE_KEY 32
+#define FROZEN_SEED_TRY 16
+#define FROZEN_MAX_DISP 0x100000
+#define ST_FROZEN (-1)	// not a value type, returned by _insert_table
+#define CHANNEL_PAD 64
+#define GC_BUFFERED 1
+#define GC_GRAY 2
+#define GC_BLACK 4
+
+#ifdef STABLE_STATS
 
 /*
-static int MEM = 0;
+	Each thread counts into its own stat_counter, so the hot paths never
+	write a shared cache line. stable_stats() walks the list and merges.
+	Counters of exited threads stay in the list, so totals never go back.
+ */
 
-static void *my_malloc(size_t sz) {
-	__sync_add_and_fetch (&MEM,1);
-	return malloc(sz);
+struct stat_counter {
+	struct stat_counter *next;
+	struct stable_stats s;
+};
+
+static struct stat_counter * S_head = NULL;
+static __thread struct stat_counter * S_local = NULL;
+
+static struct stable_stats *
+_stat_local() {
+	struct stat_counter *c = S_local;
+	if (c == NULL) {
+		c = malloc(sizeof(*c));
+		memset(c,0,sizeof(*c));
+		do {
+			c->next = S_head;
+		} while (!__sync_bool_compare_and_swap(&S_head, c->next, c));
+		S_local = c;
+	}
+	return &c->s;
 }
-static void my_free(void *p) {
-	__sync_sub_and_fetch (&MEM,1);
-	free(p);
+
+static inline void
+_stat_probe(int depth) {
+	struct stable_stats *s = _stat_local();
+	++s->lookup;
+	s->probe += depth;
+	if (depth > s->probe_max) {
+		s->probe_max = depth;
+	}
 }
 
-#define malloc my_malloc
-#define free my_free
-*/
+#define STAT_INC(f) (++_stat_local()->f)
+#define STAT_DEC(f) (--_stat_local()->f)
+#define STAT_ADD(f, n) (_stat_local()->f += (n))
+#define STAT_PROBE(depth) _stat_probe(depth)
+#define STAT_RETRY(cond, f) ((cond) ? (STAT_INC(f), 1) : 0)
+
+#else
+
+#define STAT_INC(f)
+#define STAT_DEC(f)
+#define STAT_ADD(f, n)
+#define STAT_PROBE(depth)
+#define STAT_RETRY(cond, f) (cond)
+
+#endif
 
 struct map;
 struct array;
+struct string_slot;
+struct frozen;
+struct post;
 
-struct string_slot {
+/*
+	All the tables of a tree share one context : the allocator and the
+	byte count of everything allocated for the tree. Replaced generations
+	(map, array, string slot) still pinned by readers are counted in both
+	total and retired until they are freed.
+
+	Replaced string slots wait in limbo lists, one per epoch mod 3, see
+	_retire_string.
+ */
+
+struct limbo {
+	unsigned long epoch;
+	struct string_slot *list;
+};
+
+struct context {
 	int ref;
+	struct stable_allocator alloc;
+	size_t total;
+	size_t retired;
+	int limbo_lock;
+	struct limbo limbo[3];
+};
+
+/*
+	The slot of a long string value up to STRING_INPLACE bytes has spare
+	capacity, and an update that fits is written in place while no view
+	pins it (ref == 1), with seq odd during the write like struct value.
+	Readers copy such a slot under the seqlock, see _rewrite_string.
+ */
+struct string_slot {
+	struct string_slot *next;	// limbo list
+	int ref;	// 1 for the owner (value or limbo list), +1 for each view
 	int sz;
+	int cap;	// bytes in buf, without the '\0'
+	unsigned seq;
 	char buf[1];
 };
 
 struct string {
-	int lock;
 	struct string_slot *slot;
+	struct context *ctx;
 };
 
 struct table {
@@ -49,90 +152,406 @@ struct table {
 	int array_lock;
 	struct map *map;
 	struct array *array;
+	struct context *ctx;
+	size_t array_count;	// non nil slots in array part
+	size_t map_index;	// integer keys in map part
+	uint32_t *nums;	// integer keys in map part by _index_bits, for keys below MAX_ARRAY_SIZE
+	int detached;	// not published yet, written by one thread without lock
+	int shard_bits;
+	struct table **shard;	// string keys live in 1<<shard_bits sub tables, selected by hash
+	struct table *next_free;	// in the reclaim queue, or in the list of _destroy
+	int gc;	// GC_* flags, see stable_collect
+	int gc_ref;	// references from outside the scanned graph
+	struct table *gc_next;	// in the candidate list
+	uint64_t version;	// bumped by each write, see _cached_search
+	struct frozen *frozen;	// immutable, replaces map, array and shards, see stable_freeze
+	struct post *post;	// write combining queue, see stable_post
+	int post_lock;	// held by the poster applying the queue
+	uint64_t post_taken;	// rounds started by _post_apply
+	uint64_t post_done;	// rounds applied
 };
 
+/*
+	A string no longer than SHORT_STRING is stored in v.str with a '\0'
+	after it, and v.str[SHORT_TAG] is its length + 1. Longer strings use
+	v.s, and v.str[SHORT_TAG] is 0. A long string never becomes short again,
+	so a reader may keep v.s after it left the map or the array.
+
+	seq is odd while a writer updates a slot in place, see _write_value.
+ */
+
 struct value {
 	int type;
+	unsigned seq;
 	union {
 		double n;
 		int b;
 		uint64_t id;
+		int64_t i;
 		struct table *t;
 		struct string *s;
+		char str[SHORT_TAG+1];
 	} v;
 };
 
 struct node {
 	struct node *next;
-	struct string_slot *k;
+	struct string_slot *k;	// NULL for an integer key
+	size_t idx;
 	struct value v;
 };
 
 struct map {
 	int ref;
 	int size;
+	int count;
 	struct node *n[1];
 };
 
+/*
+	An array part smaller than ARRAY_CHUNK keeps its values after the header,
+	and a larger one points to size/ARRAY_CHUNK chunks. A new generation of a
+	large array copies the chunk pointers and adds chunks, so the chunks are
+	shared by all the generations : they belong to the table, and are only
+	freed with its last generation by _delete_array.
+ */
 struct array {
 	int ref;
 	int size;
-	struct value a[1];
+	struct value *chunk[1];
+};
+
+static inline struct value *
+_array_slot(struct array *a, size_t idx) {
+	return &a->chunk[idx >> ARRAY_CHUNK_BITS][idx & (ARRAY_CHUNK-1)];
+}
+
+/*
+	A frozen table is one blob : the header, the values of the keys
+	[0, narray), the other keys in slots placed by a minimal perfect hash
+	(hash and displace : a key goes to bucket _frozen_bucket, and the
+	displacement of the bucket selects its slot), then key strings and long
+	strings. Long strings keep the layout of struct string, so they are read
+	and pinned as usual, and never replaced.
+ */
+
+struct frozen_slot {
+	const char *key;	// NULL for an integer key
+	size_t sz_idx;
+	struct value v;
+};
+
+struct frozen {
+	size_t size;
+	uint32_t seed;
+	uint32_t narray;
+	uint32_t nslot;
+	uint32_t nbucket;
+	struct value *array;
+	struct frozen_slot *slot;
+	uint32_t *disp;
 };
 
+// the values of a frozen table are numbered [0, narray + nslot)
+static inline struct value *
+_frozen_value(struct frozen *f, uint32_t i) {
+	return i < f->narray ? &f->array[i] : &f->slot[i - f->narray].v;
+}
+
+static void *
+_default_alloc(void *ud, size_t sz) {
+	return malloc(sz);
+}
+
+static void
+_default_free(void *ud, void *p, size_t sz) {
+	free(p);
+}
+
+static inline void *
+_alloc(struct context *ctx, size_t sz) {
+	__sync_add_and_fetch(&ctx->total, sz);
+	return ctx->alloc.alloc(ctx->alloc.ud, sz);
+}
+
 static inline void
-_table_lock(struct table *t) {
-	while (__sync_lock_test_and_set(&t->lock, 1)) {}
+_free(struct context *ctx, void *p, size_t sz) {
+	__sync_sub_and_fetch(&ctx->total, sz);
+	ctx->alloc.free(ctx->alloc.ud, p, sz);
 }
 
 static inline void
-_table_unlock(struct table *t) {
-	__sync_lock_release(&t->lock);
+_retire(struct context *ctx, size_t sz) {
+	__sync_add_and_fetch(&ctx->retired, sz);
 }
 
-static inline struct string_slot *
-_grab_string(struct string *s) {
-	while (__sync_lock_test_and_set(&s->lock, 1)) {}
-		int ref = __sync_add_and_fetch(&s->slot->ref,1);
-		assert(ref > 1);
-		struct string_slot * ret = s->slot;
-	__sync_lock_release(&s->lock);
-	return ret;
+static inline void
+_free_retired(struct context *ctx, void *p, size_t sz) {
+	__sync_sub_and_fetch(&ctx->retired, sz);
+	_free(ctx, p, sz);
+}
+
+static inline size_t
+_string_size(struct string_slot *s) {
+	return sizeof(*s) + s->cap;
+}
+
+static inline size_t
+_array_size(struct array *a) {
+	if (a->size < ARRAY_CHUNK) {
+		return sizeof(*a) + a->size * sizeof(struct value);
+	}
+	return sizeof(*a) + ((a->size >> ARRAY_CHUNK_BITS) - 1) * sizeof(struct value *);
+}
+
+static inline size_t
+_map_size(struct map *m) {
+	return sizeof(*m) + (m->size-1) * sizeof(struct node *);
+}
+
+static inline size_t
+_map_size_with_node(struct map *m) {
+	return _map_size(m) + m->count * sizeof(struct node);
+}
+
+/*
+	Epoch based reclamation, used for string slots.
+
+	A reader publishes the global epoch in its thread record while it
+	touches a slot, so reading a string is a store to a thread local line
+	plus the copy. A writer swaps the slot pointer and puts the old slot in
+	the limbo list of the current epoch. The global epoch only advances when
+	every active reader has seen it, so a slot retired in epoch e can be
+	freed once the global epoch reaches e+2.
+ */
+
+struct epoch_record {
+	struct epoch_record *next;
+	unsigned long epoch;	// 0 : not reading
+	int depth;
+};
+
+static unsigned long E_global = 1;
+static struct epoch_record * E_head = NULL;
+static __thread struct epoch_record * E_local = NULL;
+
+static struct epoch_record *
+_epoch_register() {
+	struct epoch_record *r = malloc(sizeof(*r));
+	memset(r,0,sizeof(*r));
+	do {
+		r->next = E_head;
+	} while (!__sync_bool_compare_and_swap(&E_head, r->next, r));
+	E_local = r;
+	return r;
+}
+
+static inline struct epoch_record *
+_epoch_enter() {
+	struct epoch_record *r = E_local;
+	if (r == NULL) {
+		r = _epoch_register();
+	}
+	if (r->depth++ == 0) {
+		r->epoch = E_global;
+		__sync_synchronize();
+	}
+	return r;
+}
+
+static inline void
+_epoch_leave(struct epoch_record *r) {
+	if (--r->depth == 0) {
+		__sync_lock_release(&r->epoch);
+	}
+}
+
+static unsigned long
+_epoch_advance() {
+	unsigned long e = E_global;
+	struct epoch_record *r;
+	for (r = E_head; r; r = r->next) {
+		unsigned long re = r->epoch;
+		if (re != 0 && re != e) {
+			return e;
+		}
+	}
+	__sync_bool_compare_and_swap(&E_global, e, e+1);
+	return E_global;
+}
+
+static inline size_t _string_size(struct string_slot *s);
+
+static void
+_free_limbo(struct context *ctx, struct string_slot *s) {
+	while (s) {
+		struct string_slot *next = s->next;
+		if (__sync_sub_and_fetch(&s->ref,1) == 0) {
+			_free_retired(ctx, s, _string_size(s));
+		}
+		s = next;
+	}
+}
+
+static void
+_retire_string(struct context *ctx, struct string_slot *s) {
+	struct string_slot *expired = NULL;
+	_retire(ctx, _string_size(s));
+	while (__sync_lock_test_and_set(&ctx->limbo_lock, 1)) {}
+		unsigned long e = _epoch_advance();
+		int i;
+		for (i=0;i<3;i++) {
+			struct limbo *l = &ctx->limbo[i];
+			if (l->list && l->epoch + 2 <= e) {
+				struct string_slot *tail = l->list;
+				while (tail->next) {
+					tail = tail->next;
+				}
+				tail->next = expired;
+				expired = l->list;
+				l->list = NULL;
+			}
+		}
+		struct limbo *l = &ctx->limbo[e % 3];
+		l->epoch = e;
+		s->next = l->list;
+		l->list = s;
+	__sync_lock_release(&ctx->limbo_lock);
+	_free_limbo(ctx, expired);
+}
+
+static inline int
+_short_string(const struct value *v) {
+	return v->v.str[SHORT_TAG] != 0;
+}
+
+static inline size_t
+_short_string_size(const struct value *v) {
+	return v->v.str[SHORT_TAG] - 1;
+}
+
+static inline void
+_read_value(struct value *result, const struct value *v) {
+	for (;;) {
+		unsigned seq = __atomic_load_n(&v->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			continue;
+		}
+		*result = *v;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (v->seq == seq) {
+			return;
+		}
+	}
+}
+
+// Only called with the table lock held, so seq has a single writer.
+static inline void
+_write_value(struct value *slot, const struct value *v) {
+	unsigned seq = slot->seq;
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->type = v->type;
+	slot->v = v->v;
+	__atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
 }
 
 static inline void
-_release_string(struct string_slot *s) {
-	if (__sync_sub_and_fetch(&s->ref,1) == 0) {
-		free(s);
+_table_lock(struct table *t) {
+	if (t->detached)
+		return;
+	while (__sync_lock_test_and_set(&t->lock, 1)) {
+		STAT_INC(lock_spin);
 	}
 }
 
+// The version is bumped after the values are written, a reader seeing it sees the values.
+static inline void
+_table_unlock(struct table *t) {
+	__atomic_store_n(&t->version, t->version + 1, __ATOMIC_RELEASE);
+	if (t->detached)
+		return;
+	__sync_lock_release(&t->lock);
+}
+
 static inline struct string_slot *
-new_string(const char *name, size_t sz) {
-	struct string_slot *s = malloc(sizeof(*s) + sz);
+_new_slot(struct context *ctx, const char *name, size_t sz, size_t cap) {
+	struct string_slot *s = _alloc(ctx, sizeof(*s) + cap);
+	s->next = NULL;
 	s->ref = 1;
 	s->sz = sz;
+	s->cap = cap;
+	s->seq = 0;
 	memcpy(s->buf, name, sz);
 	s->buf[sz] = '\0';
 	return s;
 }
 
+static inline struct string_slot *
+new_string(struct context *ctx, const char *name, size_t sz) {
+	return _new_slot(ctx, name, sz, sz);
+}
+
+// a value slot, with room for a longer string if it's small
+static inline struct string_slot *
+_new_value_slot(struct context *ctx, const char *name, size_t sz) {
+	size_t cap = sz;
+	if (sz < STRING_INPLACE) {
+		cap = (sz + 16) & ~(size_t)15;
+		if (cap > STRING_INPLACE) {
+			cap = STRING_INPLACE;
+		}
+	}
+	return _new_slot(ctx, name, sz, cap);
+}
+
+/*
+	Rewrite s in place, returns 0 if a view pins it or another writer is
+	rewriting it. Setting seq odd before reading ref pairs with _pin_string
+	adding its reference before reading seq : either the writer sees the
+	view and gives up, or the view waits for the write to end.
+ */
+static int
+_rewrite_string(struct string_slot *s, const char *name, size_t sz) {
+	unsigned seq = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+	if ((seq & 1) || !__sync_bool_compare_and_swap(&s->seq, seq, seq + 1)) {
+		return 0;
+	}
+	if (__atomic_load_n(&s->ref, __ATOMIC_SEQ_CST) != 1) {
+		__atomic_store_n(&s->seq, seq + 2, __ATOMIC_RELEASE);
+		return 0;
+	}
+	memcpy(s->buf, name, sz);
+	s->buf[sz] = '\0';
+	s->sz = sz;
+	__atomic_store_n(&s->seq, seq + 2, __ATOMIC_RELEASE);
+	return 1;
+}
+
 static inline void
 _update_string(struct string *s, const char *name, size_t sz) {
-	struct string_slot * ns = new_string(name,sz);
-	while (__sync_lock_test_and_set(&s->lock, 1)) {}
-		struct string_slot * old = s->slot;
-		s->slot = ns;
-		int ref = __sync_sub_and_fetch(&old->ref,1);
-	__sync_lock_release(&s->lock);
-	if (ref == 0) {
-		free(old);
+	if (sz <= STRING_INPLACE) {
+		struct epoch_record *r = _epoch_enter();
+		struct string_slot *old = s->slot;
+		// a slot replaced meanwhile may be rewritten, write again in the new one
+		int done = sz <= old->cap && old->cap <= STRING_INPLACE
+			&& _rewrite_string(old, name, sz) && s->slot == old;
+		_epoch_leave(r);
+		if (done) {
+			STAT_INC(string_inplace);
+			return;
+		}
 	}
+	struct string_slot * ns = _new_value_slot(s->ctx, name,sz);
+	struct string_slot * old = __sync_lock_test_and_set(&s->slot, ns);
+	_retire_string(s->ctx, old);
 }
 
 static inline struct array *
 _grab_array(struct table *t) {
-	while (__sync_lock_test_and_set(&t->array_lock, 1)) {}
+	while (__sync_lock_test_and_set(&t->array_lock, 1)) {
+		STAT_INC(grab_spin);
+	}
 		int ref = __sync_add_and_fetch(&t->array->ref,1);
 		assert(ref > 1);
 		struct array * ret = t->array;
@@ -141,27 +560,35 @@ _grab_array(struct table *t) {
 }
 
 static inline void
-_release_array(struct array *a) {
+_release_array(struct context *ctx, struct array *a) {
 	if (__sync_sub_and_fetch(&a->ref,1) == 0) {
-		free(a);
+		STAT_DEC(array_live);
+		_free_retired(ctx, a, _array_size(a));
 	}
 }
 
 static inline void
 _update_array(struct table *t, struct array *a) {
-	while (__sync_lock_test_and_set(&t->array_lock, 1)) {}
+	while (__sync_lock_test_and_set(&t->array_lock, 1)) {
+		STAT_INC(grab_spin);
+	}
 		struct array *old = t->array;
 		t->array = a;
 		int ref = __sync_sub_and_fetch(&old->ref,1);
 	__sync_lock_release(&t->array_lock);
 	if (ref == 0) {
-		free(old);
+		STAT_DEC(array_live);
+		_free(t->ctx, old, _array_size(old));
+	} else {
+		_retire(t->ctx, _array_size(old));
 	}
 }
 
 static inline struct map *
 _grab_map(struct table *t) {
-	while (__sync_lock_test_and_set(&t->map_lock, 1)) {}
+	while (__sync_lock_test_and_set(&t->map_lock, 1)) {
+		STAT_INC(grab_spin);
+	}
 		int ref = __sync_add_and_fetch(&t->map->ref,1);
 		assert(ref > 1);
 		struct map * ret = t->map;
@@ -170,91 +597,195 @@ _grab_map(struct table *t) {
 }
 
 static void
-_delete_map_without_data(struct map *m) {
+_delete_map_without_data(struct context *ctx, struct map *m) {
 	int i;
 	for (i=0;i<m->size;i++) {
 		struct node * n = m->n[i];
 		while(n) {
 			struct node * next = n->next;
-			free(n);
+			_free(ctx, n, sizeof(*n));
 			n = next;
 		}
 	}
-	free(m);
+	STAT_DEC(map_live);
+	_free(ctx, m, _map_size(m));
 }
 
 static inline void
-_release_map(struct map *m) {
+_release_map(struct context *ctx, struct map *m) {
 	if (__sync_sub_and_fetch(&m->ref,1) == 0) {
-		_delete_map_without_data(m);
+		__sync_sub_and_fetch(&ctx->retired, _map_size_with_node(m));
+		_delete_map_without_data(ctx, m);
 	}
 }
 
 static inline void
 _update_map(struct table *t, struct map *m) {
-	while (__sync_lock_test_and_set(&t->map_lock, 1)) {}
+	while (__sync_lock_test_and_set(&t->map_lock, 1)) {
+		STAT_INC(grab_spin);
+	}
 		struct map * old = t->map;
 		t->map = m;
 		int ref = __sync_sub_and_fetch(&old->ref,1);
 	__sync_lock_release(&t->map_lock);
 	if (ref == 0) {
-		_delete_map_without_data(old);
+		_delete_map_without_data(t->ctx, old);
+	} else {
+		_retire(t->ctx, _map_size_with_node(old));
 	}
 }
 
-struct table *
-stable_create() {
-	struct table * t = malloc(sizeof(*t));
+static uint32_t G_version = 0;
+
+static struct table *
+_create_table(struct context *ctx) {
+	struct table * t = _alloc(ctx, sizeof(*t));
 	memset(t,0,sizeof(*t));
 	t->ref = 1;
+	// a new table at the address of a freed one never matches its cached versions
+	t->version = (uint64_t)__sync_add_and_fetch(&G_version, 1) << 32;
 	t->magic = MAGIC_NUMBER;
+	t->ctx = ctx;
+	__sync_add_and_fetch(&ctx->ref, 1);
 	return t;
-};
+}
+
+struct table *
+stable_create_ex(const struct stable_allocator *alloc) {
+	struct stable_allocator default_alloc = { _default_alloc, _default_free, NULL };
+	if (alloc == NULL) {
+		alloc = &default_alloc;
+	}
+	struct context * ctx = alloc->alloc(alloc->ud, sizeof(*ctx));
+	memset(ctx,0,sizeof(*ctx));
+	ctx->alloc = *alloc;
+	return _create_table(ctx);
+}
+
+struct table *
+stable_create() {
+	return stable_create_ex(NULL);
+}
+
+struct table *
+stable_create_child(struct table *parent) {
+	return _create_table(parent->ctx);
+}
+
+struct table *
+stable_create_sharded(struct table *parent, int n) {
+	struct table * t = parent ? stable_create_child(parent) : stable_create();
+	int bits = 1;
+	while ((1 << bits) < n && bits < MAX_SHARD_BITS) {
+		++bits;
+	}
+	t->shard = _alloc(t->ctx, sizeof(struct table *) << bits);
+	int i;
+	for (i=0;i<(1<<bits);i++) {
+		t->shard[i] = _create_table(t->ctx);
+	}
+	t->shard_bits = bits;
+	return t;
+}
+
+struct table *
+stable_create_detached(struct table *parent) {
+	struct table * t = parent ? stable_create_child(parent) : stable_create();
+	t->detached = 1;
+	return t;
+}
 
 void 
 stable_grab(struct table * t) {
 	__sync_add_and_fetch(&t->ref, 1);
 }
 
+/*
+	While cycle tracking is on, a table losing a reference but still alive
+	may be the entry of a garbage cycle. It's pushed once (GC_BUFFERED) to
+	G_candidate, and the list holds a reference, so it stays valid until
+	stable_collect looks at it.
+ */
+
+static struct table * volatile G_candidate = NULL;
+static volatile int G_track = 0;
+
+static inline void
+_gc_candidate(struct table *t) {
+	if (G_track && t->ref > 1 && t->gc == 0 && __sync_bool_compare_and_swap(&t->gc, 0, GC_BUFFERED)) {
+		__sync_add_and_fetch(&t->ref, 1);
+		struct table *head;
+		do {
+			head = G_candidate;
+			t->gc_next = head;
+		} while (!__sync_bool_compare_and_swap(&G_candidate, head, t));
+	}
+}
+
+// Subtables whose last reference is dropped are pushed to *pending instead of freed recursively.
 static void
-_clear_value(struct value *v) {
+_clear_value(struct value *v, struct table **pending) {
 	switch(v->type) {
-	case ST_STRING:
-		free(v->v.s->slot);
-		free(v->v.s);
+	case ST_STRING: {
+		if (_short_string(v)) {
+			break;
+		}
+		struct string *s = v->v.s;
+		_free(s->ctx, s->slot, _string_size(s->slot));
+		_free(s->ctx, s, sizeof(*s));
 		break;
-	case ST_TABLE:
-		stable_release(v->v.t);
+	}
+	case ST_TABLE: {
+		struct table *t = v->v.t;
+		if (t == NULL || pending == NULL) {
+			// without pending, the reference moves to a frozen table
+			break;
+		}
+		_gc_candidate(t);
+		if (__sync_sub_and_fetch(&t->ref,1) == 0) {
+			t->next_free = *pending;
+			*pending = t;
+		}
 		break;
 	}
+	}
 }
 
 static void
-_delete_array(struct array *a) {
+_delete_array(struct context *ctx, struct array *a, struct table **pending) {
 	assert(a->ref == 1);
 	int i;
 	for (i=0;i<a->size;i++) {
-		struct value *v = &a->a[i];
-		_clear_value(v);
+		struct value *v = _array_slot(a, i);
+		_clear_value(v, pending);
+	}
+	if (a->size >= ARRAY_CHUNK) {
+		for (i=0;i<(a->size >> ARRAY_CHUNK_BITS);i++) {
+			_free(ctx, a->chunk[i], ARRAY_CHUNK * sizeof(struct value));
+		}
 	}
-	free(a);
+	STAT_DEC(array_live);
+	_free(ctx, a, _array_size(a));
 }
 
 static void
-_delete_map(struct map *m) {
+_delete_map(struct context *ctx, struct map *m, struct table **pending) {
 	assert(m->ref == 1);
 	int i;
 	for (i=0;i<m->size;i++) {
 		struct node * n = m->n[i];
 		while(n) {
 			struct node * next = n->next;
-			free(n->k);
-			_clear_value(&n->v);
-			free(n);
+			if (n->k) {
+				_free(ctx, n->k, _string_size(n->k));
+			}
+			_clear_value(&n->v, pending);
+			_free(ctx, n, sizeof(*n));
 			n = next;
 		}
 	}
-	free(m);
+	STAT_DEC(map_live);
+	_free(ctx, m, _map_size(m));
 }
 
 int
@@ -262,85 +793,540 @@ stable_getref(struct table *t) {
 	return t->ref;
 }
 
-void 
-stable_release(struct table *t) {
-	if (t) {
-		if (__sync_sub_and_fetch(&t->ref,1) != 0) {
-			return;
+static void _post_free(struct context *ctx, struct post *p, struct table **pending);
+
+static void
+_free_table(struct table *t, struct table **pending) {
+	struct context *ctx = t->ctx;
+	if (t->frozen) {
+		struct frozen *f = t->frozen;
+		uint32_t i;
+		for (i=0;i<f->narray + f->nslot;i++) {
+			struct value *v = _frozen_value(f, i);
+			// strings are in the blob
+			if (v->type == ST_TABLE) {
+				_clear_value(v, pending);
+			}
 		}
-		if (t->array) {
-			_delete_array(t->array);
+		_free(ctx, f, f->size);
+	}
+	if (t->post) {
+		_post_free(ctx, t->post, pending);
+	}
+	if (t->nums) {
+		_free(ctx, t->nums, ARRAY_BITS * sizeof(uint32_t));
+	}
+	if (t->array) {
+		_delete_array(ctx, t->array, pending);
+	}
+	if (t->map) {
+		_delete_map(ctx, t->map, pending);
+	}
+	if (t->shard) {
+		int i;
+		for (i=0;i<(1<<t->shard_bits);i++) {
+			struct table *s = t->shard[i];
+			if (__sync_sub_and_fetch(&s->ref,1) == 0) {
+				s->next_free = *pending;
+				*pending = s;
+			}
 		}
-		if (t->map) {
-			_delete_map(t->map);
+		_free(ctx, t->shard, sizeof(struct table *) << t->shard_bits);
+	}
+	t->magic = 0;
+	_free(ctx, t, sizeof(*t));
+	if (__sync_sub_and_fetch(&ctx->ref,1) == 0) {
+		int i;
+		for (i=0;i<3;i++) {
+			_free_limbo(ctx, ctx->limbo[i].list);
 		}
-		t->magic = 0;
-		free(t);
-//		printf("memory = %d\n",MEM);
+		ctx->alloc.free(ctx->alloc.ud, ctx, sizeof(*ctx));
 	}
 }
 
-static struct array *
-_create_array(size_t n) {
-	struct array *a;
-	size_t sz = sizeof(*a) + (n-1) * sizeof(struct value);
-	a = malloc(sz);
-	memset(a,0,sz);
-	a->ref = 1;
-	a->size = n;
-	return a;
-}
-
-static struct array *
-_init_array(struct table *t, int cap) {
-	int size = DEFAULT_SIZE;
-	while (cap >= size) {
-		size *=2;
+// Free t and its subtrees with an explicit list, so deep trees don't overflow the stack.
+static void
+_destroy(struct table *t, int yield) {
+	struct table *pending = t;
+	int n = 0;
+	t->next_free = NULL;
+	while (pending) {
+		t = pending;
+		pending = t->next_free;
+		_free_table(t, &pending);
+		if (yield && ++n % RECLAIM_BATCH == 0) {
+			sched_yield();
+		}
 	}
-	struct array *a = _create_array(size);
-	t->array = a;
-	return a;
 }
 
-static struct map *
-_create_hash(size_t n) {
-	struct map *m;
-	size_t sz = sizeof(*m) + (n-1) * sizeof(struct node *);
-	m = malloc(sz);
-	memset(m,0,sz);
-	m->ref = 1;
-	m->size = n;
-	return m;
+#ifdef __linux__
+
+static inline void
+_futex_wait(int *addr, int v) {
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, v, NULL, NULL, 0);
 }
 
-static struct map *
-_init_map(struct table *t) {
-	struct map *m = _create_hash(DEFAULT_SIZE);
-	t->map = m;
-	return m;
+static inline void
+_futex_wake(int *addr) {
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
 }
 
-static void
-_search_array(struct table *t, size_t idx, struct value *result) {
-	struct array *a;
-	do {
-		a = _grab_array(t);
-		if (idx < a->size) {
-			*result = a->a[idx];
-		} else {
-			result->type = ST_NIL;
-		}
-		_release_array(a);
-	} while(a!=t->array);
+#else
+
+static inline void
+_futex_wait(int *addr, int v) {
+	if (__atomic_load_n(addr, __ATOMIC_ACQUIRE) == v) {
+		usleep(100);
+	}
 }
 
-static inline uint32_t
-hash(const char *name,size_t len) {
-	uint32_t h=(uint32_t)len;
-	size_t i;
-	for (i=0; i<len; i++)
-	    h = h ^ ((h<<5)+(h>>2)+(uint32_t)name[i]);
-	return h;
+static inline void
+_futex_wake(int *addr) {
+}
+
+#endif
+
+// bump the futex word, and wake the threads sleeping on it
+static inline void
+_futex_notify(int *seq, int *wait) {
+	__sync_add_and_fetch(seq, 1);
+	if (__atomic_load_n(wait, __ATOMIC_SEQ_CST)) {
+		_futex_wake(seq);
+	}
+}
+
+/*
+	The reclaimer is an optional thread freeing released trees. stable_release
+	pushes the root to R_queue (a lock free stack) in O(1), and the reclaimer
+	takes the whole stack and frees it in batches of RECLAIM_BATCH tables.
+	The reclaimer sleeps on R_seq when the queue is empty, and flush sleeps
+	on R_done until R_pending drops to 0.
+ */
+
+static struct table * volatile R_queue = NULL;
+static int R_pending = 0;	// trees pushed and not freed yet
+static volatile int R_state = 0;	// 0 stopped, 1 running, 2 stopping
+static int R_seq = 0;	// bumped by a push or a stop
+static int R_wait = 0;	// the reclaimer sleeps on R_seq
+static int R_done = 0;	// bumped when R_pending drops to 0
+static int R_flush = 0;	// threads sleeping on R_done
+static pthread_t R_thread;
+
+static inline void
+_reclaim_done() {
+	if (__sync_sub_and_fetch(&R_pending, 1) == 0) {
+		_futex_notify(&R_done, &R_flush);
+	}
+}
+
+static void
+_reclaim_list(struct table *list, int yield) {
+	while (list) {
+		struct table *t = list;
+		list = t->next_free;
+		_destroy(t, yield);
+		_reclaim_done();
+	}
+}
+
+static void *
+_reclaimer(void *ud) {
+	for (;;) {
+		int seq = __atomic_load_n(&R_seq, __ATOMIC_SEQ_CST);
+		struct table *list = __sync_lock_test_and_set(&R_queue, NULL);
+		if (list == NULL) {
+			if (R_state != 1)
+				break;
+			__sync_add_and_fetch(&R_wait, 1);
+			_futex_wait(&R_seq, seq);
+			__sync_sub_and_fetch(&R_wait, 1);
+			continue;
+		}
+		_reclaim_list(list, 1);
+	}
+	return NULL;
+}
+
+int
+stable_reclaim_start() {
+	if (!__sync_bool_compare_and_swap(&R_state, 0, 1)) {
+		return 1;
+	}
+	if (pthread_create(&R_thread, NULL, _reclaimer, NULL)) {
+		R_state = 0;
+		return 1;
+	}
+	return 0;
+}
+
+void
+stable_reclaim_flush() {
+	for (;;) {
+		int seq = __atomic_load_n(&R_done, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&R_pending, __ATOMIC_SEQ_CST) == 0) {
+			return;
+		}
+		__sync_add_and_fetch(&R_flush, 1);
+		_futex_wait(&R_done, seq);
+		__sync_sub_and_fetch(&R_flush, 1);
+	}
+}
+
+void
+stable_reclaim_stop() {
+	if (!__sync_bool_compare_and_swap(&R_state, 1, 2)) {
+		return;
+	}
+	_futex_notify(&R_seq, &R_wait);
+	pthread_join(R_thread, NULL);
+	/*
+		A release counts itself in R_pending before it checks R_state, so
+		one that saw the reclaimer running is counted here, and it may not
+		have pushed yet : drain until R_pending is 0.
+	 */
+	while (__atomic_load_n(&R_pending, __ATOMIC_SEQ_CST)) {
+		struct table *list = __sync_lock_test_and_set(&R_queue, NULL);
+		if (list == NULL) {
+			sched_yield();
+			continue;
+		}
+		_reclaim_list(list, 0);
+	}
+	R_state = 0;
+}
+
+void 
+stable_release(struct table *t) {
+	if (t) {
+		_gc_candidate(t);
+		if (__sync_sub_and_fetch(&t->ref,1) != 0) {
+			return;
+		}
+		if (R_state == 1) {
+			// count it first, so stable_reclaim_stop waits for the push, and check again
+			__sync_add_and_fetch(&R_pending, 1);
+			if (R_state == 1) {
+				struct table *head;
+				do {
+					head = R_queue;
+					t->next_free = head;
+				} while (!__sync_bool_compare_and_swap(&R_queue, head, t));
+				_futex_notify(&R_seq, &R_wait);
+				return;
+			}
+			_reclaim_done();
+		}
+		_destroy(t, 0);
+	}
+}
+
+/*
+	Cycle collection by trial deletion. Starting from the candidates, the
+	scanned graph is every table reachable from them. Each table starts with
+	gc_ref = ref (minus the candidate list reference), and every edge inside
+	the graph is subtracted. A table left with gc_ref > 0 is referenced from
+	outside, so it and everything reachable from it is alive (GC_BLACK). The
+	rest (GC_GRAY only) is referenced only by garbage, and is freed.
+
+	Readers never change references, so they may run during a collection.
+	Writers of table values, grab and release may not.
+ */
+
+struct gc_set {
+	struct table **t;
+	size_t n;
+	size_t cap;
+};
+
+typedef void (*gc_func)(struct gc_set *s, struct table *t);
+
+static void
+_gc_push(struct gc_set *s, struct table *t) {
+	if (s->n >= s->cap) {
+		s->cap = s->cap ? s->cap * 2 : 64;
+		s->t = realloc(s->t, s->cap * sizeof(struct table *));
+	}
+	s->t[s->n++] = t;
+}
+
+static void
+_gc_children(struct table *t, gc_func f, struct gc_set *s) {
+	if (t->frozen) {
+		struct frozen *fz = t->frozen;
+		uint32_t i;
+		for (i=0;i<fz->narray + fz->nslot;i++) {
+			struct value *v = _frozen_value(fz, i);
+			if (v->type == ST_TABLE && v->v.t) {
+				f(s, v->v.t);
+			}
+		}
+	}
+	if (t->shard) {
+		int i;
+		for (i=0;i<(1<<t->shard_bits);i++) {
+			f(s, t->shard[i]);
+		}
+	}
+	if (t->array) {
+		struct array *a = t->array;
+		int i;
+		for (i=0;i<a->size;i++) {
+			struct value *v = _array_slot(a, i);
+			if (v->type == ST_TABLE && v->v.t) {
+				f(s, v->v.t);
+			}
+		}
+	}
+	if (t->map) {
+		struct map *m = t->map;
+		int i;
+		for (i=0;i<m->size;i++) {
+			struct node *n;
+			for (n = m->n[i]; n; n = n->next) {
+				if (n->v.type == ST_TABLE && n->v.v.t) {
+					f(s, n->v.v.t);
+				}
+			}
+		}
+	}
+}
+
+static void
+_gc_gray(struct gc_set *s, struct table *t) {
+	if (t->gc & GC_GRAY) {
+		return;
+	}
+	t->gc |= GC_GRAY;
+	t->gc_ref = t->ref - (t->gc & GC_BUFFERED ? 1 : 0);
+	_gc_push(s, t);
+}
+
+static void
+_gc_trial(struct gc_set *s, struct table *t) {
+	--t->gc_ref;
+}
+
+static void
+_gc_black(struct gc_set *s, struct table *t) {
+	if (t->gc & GC_BLACK) {
+		return;
+	}
+	t->gc |= GC_BLACK;
+	_gc_push(s, t);
+}
+
+static inline int
+_gc_white(struct value *v) {
+	return v->type == ST_TABLE && v->v.t && (v->v.t->gc & (GC_GRAY | GC_BLACK)) == GC_GRAY;
+}
+
+// Drop the references between garbage tables, each of them is freed once by stable_collect.
+static void
+_gc_unlink(struct table *t) {
+	if (t->frozen) {
+		struct frozen *f = t->frozen;
+		uint32_t i;
+		for (i=0;i<f->narray + f->nslot;i++) {
+			struct value *v = _frozen_value(f, i);
+			if (_gc_white(v)) {
+				v->type = ST_NIL;
+			}
+		}
+	}
+	if (t->shard) {
+		_free(t->ctx, t->shard, sizeof(struct table *) << t->shard_bits);
+		t->shard = NULL;
+	}
+	if (t->array) {
+		struct array *a = t->array;
+		int i;
+		for (i=0;i<a->size;i++) {
+			if (_gc_white(_array_slot(a, i))) {
+				_array_slot(a, i)->type = ST_NIL;
+			}
+		}
+	}
+	if (t->map) {
+		struct map *m = t->map;
+		int i;
+		for (i=0;i<m->size;i++) {
+			struct node *n;
+			for (n = m->n[i]; n; n = n->next) {
+				if (_gc_white(&n->v)) {
+					n->v.type = ST_NIL;
+				}
+			}
+		}
+	}
+}
+
+size_t
+stable_collect() {
+	struct table *list = __sync_lock_test_and_set(&G_candidate, NULL);
+	struct gc_set all = { NULL, 0, 0 };
+	struct gc_set stack = { NULL, 0, 0 };
+	struct table *t;
+	size_t i;
+	for (t = list; t; t = t->gc_next) {
+		_gc_gray(&all, t);
+	}
+	// all grows while it's scanned
+	for (i=0;i<all.n;i++) {
+		_gc_children(all.t[i], _gc_gray, &all);
+	}
+	for (i=0;i<all.n;i++) {
+		_gc_children(all.t[i], _gc_trial, NULL);
+	}
+	for (i=0;i<all.n;i++) {
+		t = all.t[i];
+		if (t->gc_ref > 0 && !(t->gc & GC_BLACK)) {
+			_gc_black(&stack, t);
+			while (stack.n > 0) {
+				struct table *b = stack.t[--stack.n];
+				_gc_children(b, _gc_black, &stack);
+			}
+		}
+	}
+	STAT_INC(gc_run);
+	STAT_ADD(gc_scan, all.n);
+	// keep the white tables in all.t[0, white), the live ones leave the candidate list
+	size_t white = 0;
+	for (i=0;i<all.n;i++) {
+		t = all.t[i];
+		if (t->gc & GC_BLACK) {
+			int buffered = t->gc & GC_BUFFERED;
+			t->gc = 0;
+			if (buffered) {
+				int ref = __sync_sub_and_fetch(&t->ref, 1);
+				assert(ref > 0);
+				(void)ref;
+			}
+		} else {
+			all.t[white++] = t;
+		}
+	}
+	for (i=0;i<white;i++) {
+		_gc_unlink(all.t[i]);
+	}
+	struct table *pending = NULL;
+	for (i=0;i<white;i++) {
+		t = all.t[i];
+		t->next_free = pending;
+		pending = t;
+	}
+	while (pending) {
+		t = pending;
+		pending = t->next_free;
+		_free_table(t, &pending);
+	}
+	STAT_ADD(gc_collect, white);
+	free(all.t);
+	free(stack.t);
+	return white;
+}
+
+void
+stable_collect_start() {
+	G_track = 1;
+}
+
+size_t
+stable_collect_stop() {
+	G_track = 0;
+	return stable_collect();
+}
+
+void
+stable_memory(struct table *t, struct stable_memory *m) {
+	m->total = t->ctx->total;
+	m->retired = t->ctx->retired;
+}
+
+// A new generation of n slots with the values of old (may be NULL), n is a power of 2.
+static struct array *
+_create_array(struct context *ctx, size_t n, struct array *old) {
+	struct array *a;
+	if (n < ARRAY_CHUNK) {
+		size_t sz = sizeof(*a) + n * sizeof(struct value);
+		a = _alloc(ctx, sz);
+		memset(a,0,sz);
+		a->chunk[0] = (struct value *)(a+1);
+	} else {
+		size_t nchunk = n >> ARRAY_CHUNK_BITS;
+		size_t i = 0;
+		a = _alloc(ctx, sizeof(*a) + (nchunk-1) * sizeof(struct value *));
+		if (old && old->size >= ARRAY_CHUNK) {
+			// share the chunks, nothing is copied
+			i = old->size >> ARRAY_CHUNK_BITS;
+			memcpy(a->chunk, old->chunk, i * sizeof(struct value *));
+			old = NULL;
+		}
+		for (;i<nchunk;i++) {
+			a->chunk[i] = _alloc(ctx, ARRAY_CHUNK * sizeof(struct value));
+			memset(a->chunk[i], 0, ARRAY_CHUNK * sizeof(struct value));
+		}
+	}
+	if (old) {
+		// old is small, its values are in its own block
+		memcpy(a->chunk[0], old->chunk[0], old->size * sizeof(struct value));
+	}
+	a->ref = 1;
+	a->size = n;
+	STAT_INC(array_live);
+	return a;
+}
+
+static struct map *
+_create_hash(struct context *ctx, size_t n) {
+	struct map *m;
+	size_t sz = sizeof(*m) + (n-1) * sizeof(struct node *);
+	m = _alloc(ctx, sz);
+	memset(m,0,sz);
+	m->ref = 1;
+	m->size = n;
+	STAT_INC(map_live);
+	return m;
+}
+
+static struct map *
+_init_map(struct table *t) {
+	struct map *m = _create_hash(t->ctx, DEFAULT_SIZE);
+	t->map = m;
+	return m;
+}
+
+// returns 0 when idx is out of the array part
+static int
+_search_array(struct table *t, size_t idx, struct value *result) {
+	struct array *a;
+	int inside;
+	do {
+		a = _grab_array(t);
+		inside = idx < a->size;
+		if (inside) {
+			_read_value(result, _array_slot(a, idx));
+		} else {
+			result->type = ST_NIL;
+		}
+		_release_array(t->ctx, a);
+	} while(STAT_RETRY(a!=t->array, array_retry));
+	return inside;
+}
+
+static inline uint32_t
+hash(const char *name,size_t len) {
+	uint32_t h=(uint32_t)len;
+	size_t i;
+	for (i=0; i<len; i++)
+	    h = h ^ ((h<<5)+(h>>2)+(uint32_t)name[i]);
+	return h;
+}
+
+static inline uint32_t
+hash_index(size_t idx) {
+	uint64_t h = (uint64_t)idx * 0x9e3779b97f4a7c15ull;
+	return (uint32_t)(h >> 32);
 }
 
 static inline int 
@@ -348,18 +1334,40 @@ cmp_string(struct string_slot * a, const char * b, size_t sz) {
 	return a->sz == sz && memcmp(a->buf, b, sz) == 0;
 }
 
+// In the map part, key NULL means the integer key sz_idx.
+
+static inline uint32_t
+_hash_key(const char *key, size_t sz_idx) {
+	return key ? hash(key,sz_idx) : hash_index(sz_idx);
+}
+
+static inline uint32_t
+_hash_node(struct node *n) {
+	return n->k ? hash(n->k->buf,n->k->sz) : hash_index(n->idx);
+}
+
+static inline int
+_match_node(struct node *n, const char *key, size_t sz_idx) {
+	if (key) {
+		return n->k && cmp_string(n->k,key,sz_idx);
+	}
+	return n->k == NULL && n->idx == sz_idx;
+}
+
 static void
 _search_map(struct table *t, const char *key, size_t sz, struct value *result) {
-	uint32_t h = hash(key,sz);
+	uint32_t h = _hash_key(key,sz);
 	struct map *m;
 	do {
 		m = _grab_map(t);
 
 		struct node *n = m->n[h & (m->size-1)];
+		int depth = 0;
 		
 		while (n) {
-			if (cmp_string(n->k,key,sz)) {
-				*result = n->v;
+			++depth;
+			if (_match_node(n,key,sz)) {
+				_read_value(result, &n->v);
 				break;
 			}
 			n=n->next;
@@ -367,20 +1375,117 @@ _search_map(struct table *t, const char *key, size_t sz, struct value *result) {
 		if (n == NULL) {
 			result->type = ST_NIL;
 		}
+		STAT_PROBE(depth);
+
+		_release_map(t->ctx, m);
+
+	} while(STAT_RETRY(m!=t->map, map_retry));
+}
+
+static inline uint32_t
+_fmix(uint32_t h) {
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+static uint32_t
+_frozen_hash(const char *key, size_t sz_idx, uint32_t seed) {
+	uint32_t h = seed * 0x9e3779b9 + 0x7f4a7c15;
+	if (key) {
+		size_t i;
+		for (i=0;i<sz_idx;i++) {
+			h = (h ^ (uint8_t)key[i]) * 16777619;
+		}
+		h ^= (uint32_t)sz_idx;
+	} else {
+		h = _fmix(h ^ (uint32_t)sz_idx) ^ (uint32_t)((uint64_t)sz_idx >> 32);
+	}
+	return _fmix(h);
+}
 
-		_release_map(m);
+static inline uint32_t
+_frozen_bucket(uint32_t h, uint32_t nbucket) {
+	return (uint32_t)(((uint64_t)h * nbucket) >> 32);
+}
 
-	} while(m!=t->map);
+static inline uint32_t
+_frozen_index(uint32_t h, uint32_t d, uint32_t n) {
+	return _fmix(h ^ (d * 0x9e3779b9 + d)) % n;
 }
 
+// Plain loads, a frozen table is never written.
 static void
-_search_table(struct table *t, const char *key, size_t sz_idx, struct value * result) {
-	if (key == NULL) {
-		if (t->array) {
-			_search_array(t,sz_idx, result);
+_frozen_search(struct frozen *f, const char *key, size_t sz_idx, struct value *result) {
+	if (key == NULL && sz_idx < f->narray) {
+		*result = f->array[sz_idx];
+		return;
+	}
+	if (f->nslot) {
+		uint32_t h = _frozen_hash(key, sz_idx, f->seed);
+		uint32_t d = f->disp[_frozen_bucket(h, f->nbucket)];
+		struct frozen_slot *s = &f->slot[_frozen_index(h, d, f->nslot)];
+		if (s->sz_idx == sz_idx && (key ? (s->key && memcmp(s->key, key, sz_idx) == 0) : s->key == NULL)) {
+			*result = s->v;
+			return;
+		}
+	}
+	result->type = ST_NIL;
+}
+
+/*
+	Integer keys out of the array part live in the map. A writer moving them
+	into a larger array publishes the array before the map without them, so
+	a reader who misses a key in the map retries if the array has changed.
+ */
+static void
+_search_index(struct table *t, size_t idx, struct value *result) {
+	if (t->frozen) {
+		_frozen_search(t->frozen, NULL, idx, result);
+		return;
+	}
+	for (;;) {
+		struct array *a = t->array;
+		if (a && _search_array(t, idx, result)) {
+			return;
+		}
+		if (t->map) {
+			_search_map(t, NULL, idx, result);
 		} else {
 			result->type = ST_NIL;
 		}
+		if (result->type != ST_NIL || a == t->array) {
+			return;
+		}
+		STAT_INC(array_retry);
+	}
+}
+
+/*
+	A sharded table keeps its string keys in shard tables, each with its own
+	lock and map generations, so writers of different keys don't contend.
+	The high bits of the hash select the shard, the low bits the bucket.
+ */
+static inline struct table *
+_route(struct table *t, const char *key, size_t sz) {
+	if (key && t->shard) {
+		return t->shard[hash(key,sz) >> (32 - t->shard_bits)];
+	}
+	return t;
+}
+
+static void
+_search_table(struct table *t, const char *key, size_t sz_idx, struct value * result) {
+	if (t->frozen) {
+		_frozen_search(t->frozen, key, sz_idx, result);
+		return;
+	}
+	t = _route(t, key, sz_idx);
+	if (key == NULL) {
+		_search_index(t, sz_idx, result);
 	} else {
 		if (t->map) {
 			_search_map(t,key,sz_idx,result);
@@ -390,20 +1495,123 @@ _search_table(struct table *t, const char *key, size_t sz_idx, struct value * re
 	}
 }
 
-int 
-stable_type(struct table *t, const char *key, size_t sz_idx, union table_value *v) {
-	struct value tmp;
-	_search_table(t,key,sz_idx,&tmp);
-	if (v) {
-		memcpy(v,&tmp.v,sizeof(*v));
-	}
-	return tmp.type;
-}
+/*
+	The read cache is an optional direct mapped cache per thread, keyed by
+	(table, key). An entry keeps a scalar value and the version of the table
+	it was read at; while the version is unchanged, a hit is one load of
+	t->version and no shared memory write. Strings and tables are not cached.
+ */
+
+struct cache_entry {
+	struct table *t;
+	uint64_t version;
+	size_t sz_idx;
+	int keyed;
+	struct value v;
+	char key[CACHE_KEY];
+};
+
+struct read_cache {
+	uint64_t hit;
+	uint64_t miss;
+	struct cache_entry e[CACHE_SIZE];
+};
+
+static __thread struct read_cache * C_local = NULL;
+
+void
+stable_cache_enable(int enable) {
+	if (enable && C_local == NULL) {
+		C_local = malloc(sizeof(struct read_cache));
+		memset(C_local, 0, sizeof(struct read_cache));
+	} else if (!enable && C_local) {
+		free(C_local);
+		C_local = NULL;
+	}
+}
+
+int
+stable_cache_stats(uint64_t *hit, uint64_t *miss) {
+	struct read_cache *c = C_local;
+	if (c == NULL) {
+		*hit = *miss = 0;
+		return 0;
+	}
+	*hit = c->hit;
+	*miss = c->miss;
+	return 1;
+}
+
+static void
+_cached_search(struct table *t, const char *key, size_t sz_idx, struct value *result) {
+	struct read_cache *c = C_local;
+	if (c == NULL || (key && sz_idx > CACHE_KEY)) {
+		_search_table(t, key, sz_idx, result);
+		return;
+	}
+	t = _route(t, key, sz_idx);
+	uint32_t h = _hash_key(key, sz_idx) ^ (uint32_t)((uintptr_t)t >> 4);
+	struct cache_entry *e = &c->e[h & (CACHE_SIZE-1)];
+	uint64_t version = __atomic_load_n(&t->version, __ATOMIC_ACQUIRE);
+	if (e->t == t && e->version == version && e->sz_idx == sz_idx &&
+		(key ? e->keyed && memcmp(e->key, key, sz_idx) == 0 : !e->keyed)) {
+		++c->hit;
+		*result = e->v;
+		return;
+	}
+	++c->miss;
+	_search_table(t, key, sz_idx, result);
+	if (result->type == ST_STRING || result->type == ST_TABLE) {
+		return;
+	}
+	e->t = t;
+	e->version = version;
+	e->sz_idx = sz_idx;
+	e->keyed = key != NULL;
+	if (key) {
+		memcpy(e->key, key, sz_idx);
+	}
+	e->v = *result;
+}
+
+int 
+stable_type(struct table *t, const char *key, size_t sz_idx, union table_value *v) {
+	struct value tmp;
+	_cached_search(t,key,sz_idx,&tmp);
+	if (v) {
+		memcpy(v,&tmp.v,sizeof(*v));
+	}
+	return tmp.type;
+}
+
+struct table *
+stable_path(struct table *t, const struct table_key *path, int n) {
+	struct value tmp;
+	int i;
+	for (i=0;i<n;i++) {
+		_search_table(t, path[i].key, path[i].sz_idx, &tmp);
+		if (tmp.type != ST_TABLE) {
+			return NULL;
+		}
+		t = tmp.v.t;
+	}
+	return t;
+}
+
+int
+stable_getpath(struct table *t, const struct table_key *path, int n, union table_value *v) {
+	assert(n > 0);
+	t = stable_path(t, path, n-1);
+	if (t == NULL) {
+		return ST_NIL;
+	}
+	return stable_type(t, path[n-1].key, path[n-1].sz_idx, v);
+}
 
 double 
 stable_number(struct table *t, const char *key, size_t sz_idx) {
 	struct value tmp;
-	_search_table(t,key,sz_idx,&tmp);
+	_cached_search(t,key,sz_idx,&tmp);
 	assert(tmp.type == ST_NIL || tmp.type == ST_NUMBER);
 	return tmp.v.n;
 }
@@ -411,7 +1619,7 @@ stable_number(struct table *t, const char *key, size_t sz_idx) {
 int 
 stable_boolean(struct table *t, const char *key, size_t sz_idx) {
 	struct value tmp;
-	_search_table(t,key,sz_idx,&tmp);
+	_cached_search(t,key,sz_idx,&tmp);
 	assert(tmp.type == ST_NIL || tmp.type == ST_BOOLEAN);
 	return tmp.v.b;
 }
@@ -419,280 +1627,2583 @@ stable_boolean(struct table *t, const char *key, size_t sz_idx) {
 uint64_t 
 stable_id(struct table *t, const char *key, size_t sz_idx) {
 	struct value tmp;
-	_search_table(t,key,sz_idx,&tmp);
+	_cached_search(t,key,sz_idx,&tmp);
 	assert(tmp.type == ST_NIL || tmp.type == ST_ID);
 	return tmp.v.id;
 }
 
-void
-stable_string(struct table *t, const char *key, size_t sz_idx, void (*sfunc)(void *ud, const char *str, size_t sz), void *ud) {
-	struct value tmp;
-	_search_table(t,key,sz_idx,&tmp);
-	if (tmp.type == ST_STRING) {
-		struct string_slot *s = _grab_string(tmp.v.s);
-		sfunc(ud,s->buf,s->sz);
-		_release_string(s);
-	} else {
-		assert(tmp.type == ST_NIL);
-		sfunc(ud,"",0);
+int64_t
+stable_integer(struct table *t, const char *key, size_t sz_idx) {
+	struct value tmp;
+	_cached_search(t,key,sz_idx,&tmp);
+	assert(tmp.type == ST_NIL || tmp.type == ST_INTEGER);
+	return tmp.v.i;
+}
+
+void
+stable_string(struct table *t, const char *key, size_t sz_idx, void (*sfunc)(void *ud, const char *str, size_t sz), void *ud) {
+	struct value tmp;
+	_search_table(t,key,sz_idx,&tmp);
+	if (tmp.type == ST_STRING) {
+		stable_value_string((union table_value *)&tmp.v, sfunc, ud);
+	} else {
+		assert(tmp.type == ST_NIL);
+		sfunc(ud,"",0);
+	}
+}
+
+void
+stable_value_string(union table_value *v, void (*sfunc)(void *ud, const char *str, size_t sz), void *ud) {
+	if (v->str[SHORT_TAG]) {
+		sfunc(ud,v->str,v->str[SHORT_TAG]-1);
+		return;
+	}
+	struct string *str = v->p;
+	struct epoch_record *r = _epoch_enter();
+	struct string_slot *s = str->slot;
+	if (s->cap <= STRING_INPLACE) {
+		// may be rewritten in place, copy it under the seqlock
+		char buf[STRING_INPLACE+1];
+		size_t sz;
+		for (;;) {
+			unsigned seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+			if (seq & 1) {
+				continue;
+			}
+			sz = s->sz;
+			if (sz > s->cap) {
+				continue;
+			}
+			memcpy(buf, s->buf, sz);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (s->seq == seq) {
+				break;
+			}
+		}
+		_epoch_leave(r);
+		buf[sz] = '\0';
+		sfunc(ud,buf,sz);
+		return;
+	}
+	sfunc(ud,s->buf,s->sz);
+	_epoch_leave(r);
+}
+
+static void
+_pin_string(union table_value *v, struct table_string *view) {
+	if (v->str[SHORT_TAG]) {
+		// a short string is copied into the view, nothing to pin
+		memcpy(view->buf, v->str, sizeof(view->buf));
+		view->str = view->buf;
+		view->sz = v->str[SHORT_TAG]-1;
+		view->slot = NULL;
+		view->ctx = NULL;
+		return;
+	}
+	struct string *str = v->p;
+	struct epoch_record *r = _epoch_enter();
+	struct string_slot *s = str->slot;
+	__sync_add_and_fetch(&s->ref, 1);
+	// a rewrite that missed the reference ends before the view reads the slot
+	while (__atomic_load_n(&s->seq, __ATOMIC_SEQ_CST) & 1) {}
+	_epoch_leave(r);
+	view->str = s->buf;
+	view->sz = s->sz;
+	view->slot = s;
+	view->ctx = str->ctx;
+}
+
+int
+stable_string_view(struct table *t, const char *key, size_t sz_idx, struct table_string *view) {
+	struct value tmp;
+	_search_table(t,key,sz_idx,&tmp);
+	if (tmp.type != ST_STRING) {
+		view->str = "";
+		view->sz = 0;
+		view->slot = NULL;
+		view->ctx = NULL;
+		return 0;
+	}
+	_pin_string((union table_value *)&tmp.v, view);
+	return 1;
+}
+
+void
+stable_value_string_view(union table_value *v, struct table_string *view) {
+	_pin_string(v, view);
+}
+
+void
+stable_string_release(struct table_string *view) {
+	struct string_slot *s = view->slot;
+	if (s && __sync_sub_and_fetch(&s->ref,1) == 0) {
+		// the slot has been replaced and left the limbo list
+		_free_retired(view->ctx, s, _string_size(s));
+	}
+	view->slot = NULL;
+}
+
+static void
+_insert_hash(struct context *ctx, struct map *m, struct node *old) {
+	uint32_t h = _hash_node(old);
+	struct node **pn = &m->n[h & (m->size-1)];
+	struct node * n = _alloc(ctx, sizeof(*n));
+	n->next = *pn;
+	n->k = old->k;
+	n->idx = old->idx;
+	n->v = old->v;
+
+	*pn = n;
+	++m->count;
+}
+
+// Copy the map into a new generation of size, leaving out the integer keys below array_size.
+static void
+_rehash(struct table *t, int size, size_t array_size) {
+	struct map * old = t->map;
+	struct map * m = _create_hash(t->ctx, size);
+
+	int i;
+	for (i=0;i<old->size;i++) {
+		struct node * n = old->n[i];
+		while (n) {
+			if (n->k || n->idx >= array_size) {
+				_insert_hash(t->ctx, m, n);
+			}
+			n = n->next;
+		}
+	}
+
+	_update_map(t,m);
+}
+
+static void 
+_expand_hash(struct table *t) {
+	STAT_INC(hash_expand);
+	_rehash(t, t->map->size * 2, 0);
+}
+
+// 0 for 0, else the number of bits of idx : keys below 1<<n have at most n bits
+static inline int
+_index_bits(size_t idx) {
+	return idx ? 64 - __builtin_clzll((unsigned long long)idx) : 0;
+}
+
+// a key of the map part below MAX_ARRAY_SIZE is added (or removed, n = -1)
+static void
+_count_index(struct table *t, size_t idx, int n) {
+	if (idx >= MAX_ARRAY_SIZE) {
+		return;
+	}
+	if (t->nums == NULL) {
+		t->nums = _alloc(t->ctx, ARRAY_BITS * sizeof(uint32_t));
+		memset(t->nums, 0, ARRAY_BITS * sizeof(uint32_t));
+	}
+	t->nums[_index_bits(idx)] += n;
+}
+
+static size_t
+_array_fit(size_t idx) {
+	size_t size = DEFAULT_SIZE;
+	while (idx >= size) {
+		size *= 2;
+	}
+	return size;
+}
+
+/*
+	Like lua's computesizes, an array part of size n is only worth it when
+	more than n/2 of its slots are used. Otherwise integer keys go to the map.
+ */
+static int
+_array_worth(struct table *t, size_t idx) {
+	if (idx >= MAX_ARRAY_SIZE) {
+		return 0;
+	}
+	size_t size = _array_fit(idx);
+	if (t->array_count + t->map_index + 1 <= size / 2) {
+		return 0;
+	}
+	size_t n = t->array_count + 1;
+	if (t->nums) {
+		// the keys of the map below size, counted like lua's nums[]
+		int i, bits = _index_bits(size - 1);
+		for (i=0;i<=bits;i++) {
+			n += t->nums[i];
+		}
+	}
+	return n > size / 2;
+}
+
+// Grow the array part to fit idx, and move the integer keys it covers out of the map.
+static struct array *
+_expand_array(struct table *t, size_t idx) {
+	struct array * old = t->array;
+	size_t sz = _array_fit(idx);
+
+	STAT_INC(array_expand);
+	struct array * a = _create_array(t->ctx, sz, old);
+	size_t moved = 0;
+	if (t->map_index) {
+		struct map *m = t->map;
+		int i;
+		for (i=0;i<m->size;i++) {
+			struct node *n;
+			for (n = m->n[i]; n; n = n->next) {
+				if (n->k == NULL && n->idx < sz) {
+					struct value *v = _array_slot(a, n->idx);
+					*v = n->v;
+					v->seq = 0;
+					_count_index(t, n->idx, -1);
+					++moved;
+				}
+			}
+		}
+	}
+
+	if (old) {
+		_update_array(t, a);
+	} else {
+		__sync_synchronize();
+		t->array = a;
+	}
+	if (moved) {
+		_rehash(t, t->map->size, sz);
+		t->array_count += moved;
+		t->map_index -= moved;
+	}
+
+	return a;
+}
+
+static struct node *
+_new_node(struct context *ctx, const char *key, size_t sz, int type) {
+	struct node * n = _alloc(ctx, sizeof(*n));
+	n->next = NULL;
+	if (key) {
+		n->k = new_string(ctx,key,sz);
+		n->idx = 0;
+	} else {
+		n->k = NULL;
+		n->idx = sz;
+	}
+	n->v.type = type;
+	return n;
+}
+
+static struct node *
+_find_node(struct map *m, const char *key, size_t sz_idx) {
+	struct node *n = m->n[_hash_key(key,sz_idx) & (m->size-1)];
+	while (n) {
+		if (_match_node(n, key, sz_idx)) {
+			return n;
+		}
+		n = n->next;
+	}
+	return NULL;
+}
+
+struct table * 
+stable_table(struct table *t, const char *key, size_t sz_idx) {
+	struct value tmp;
+	_search_table(t,key,sz_idx,&tmp);
+	if (tmp.type == ST_TABLE) {
+		return tmp.v.t;
+	} 
+	assert(tmp.type == ST_NIL);
+	return NULL;
+}
+
+static int _insert_map_value(struct table *t, const char *key, size_t sz, struct value *v);
+
+static int
+_insert_array_value(struct table *t, size_t idx, struct value *v) {
+	struct array *a = t->array;
+	if (a == NULL || idx >= a->size) {
+		if ((t->map_index && _find_node(t->map, NULL, idx)) || !_array_worth(t, idx)) {
+			return _insert_map_value(t, NULL, idx, v);
+		}
+		a = _expand_array(t, idx);
+	}
+	struct value *slot = _array_slot(a, idx);
+	int type = slot->type;
+	if (type == ST_NIL) {
+		++t->array_count;
+	}
+	if (type == ST_NIL || type == v->type) {
+		_write_value(slot, v);
+	}
+	return type;
+}
+
+static int
+_insert_map_value(struct table *t, const char *key, size_t sz, struct value *v) {
+	struct map *m = t->map;
+	if (m == NULL) {
+		m = _init_map(t);
+	}
+	uint32_t h = _hash_key(key,sz);
+	struct node **pn = &m->n[h & (m->size-1)];
+	int depth = 0;
+	while (*pn) {
+		struct node *tmp = *pn;
+		if (_match_node(tmp, key, sz)) {
+			int type = tmp->v.type;
+			if (type == v->type) {
+				_write_value(&tmp->v, v);
+			}
+			return type;
+		}
+		pn = &tmp->next;
+		++depth;
+	}
+
+	struct node * n = _new_node(t->ctx,key,sz,v->type);
+	n->v = *v;
+	n->v.seq = 0;
+	__sync_synchronize();
+	*pn = n;
+	++m->count;
+	if (key == NULL) {
+		++t->map_index;
+		_count_index(t, sz, 1);
+	}
+
+	if (depth > MAX_HASH_DEPTH) {
+		_expand_hash(t);
+	}
+
+	return ST_NIL;
+}
+
+static inline int
+_insert_value(struct table *t, const char *key, size_t sz_idx, struct value *v) {
+	if (key == NULL) {
+		return _insert_array_value(t, sz_idx , v);
+	} else {
+		return _insert_map_value(t,key,sz_idx, v);
+	}
+}
+
+// returns the type of the old value, ST_FROZEN if t is frozen
+static inline int
+_insert_table(struct table *t, const char *key, size_t sz_idx, struct value *v) {
+	if (t->frozen) {
+		return ST_FROZEN;
+	}
+	t = _route(t, key, sz_idx);
+	_table_lock(t);
+	int type = _insert_value(t, key, sz_idx, v);
+	_table_unlock(t);
+	return type;
+}
+
+// The slot of key in the current generation, for writers holding the table lock.
+static struct value *
+_find_slot(struct table *t, const char *key, size_t sz_idx) {
+	if (key == NULL) {
+		struct array *a = t->array;
+		if (a && sz_idx < a->size) {
+			return _array_slot(a, sz_idx);
+		}
+	}
+	struct map *m = t->map;
+	if (m == NULL) {
+		return NULL;
+	}
+	struct node *n = _find_node(m, key, sz_idx);
+	return n ? &n->v : NULL;
+}
+
+int
+stable_settable(struct table *t, const char *key, size_t sz_idx, struct table * sub) {
+	struct value tmp;
+	if (t->frozen) {
+		return 1;
+	}
+	_search_table(t,key,sz_idx,&tmp);
+	if (tmp.type == ST_TABLE) {
+		stable_release(tmp.v.t);
+	}
+
+	tmp.type = ST_TABLE;
+	tmp.v.t = sub;
+	int type = _insert_table(t,key,sz_idx,&tmp);
+	if (type != ST_NIL && type!= ST_TABLE) {
+		return 1;
+	}
+	return 0;
+}
+
+int
+stable_setnumber(struct table *t, const char *key, size_t sz_idx, double n) {
+	struct value tmp;
+	tmp.type = ST_NUMBER;
+	tmp.v.n = n;
+	int type = _insert_table(t,key,sz_idx,&tmp);
+	return type != ST_NUMBER && type != ST_NIL;
+}
+
+int
+stable_setboolean(struct table *t, const char *key, size_t sz_idx, int b) {
+	struct value tmp;
+	tmp.type = ST_BOOLEAN;
+	tmp.v.b = b;
+	int type = _insert_table(t,key,sz_idx,&tmp);
+	return type != ST_BOOLEAN && type != ST_NIL;
+}
+
+int
+stable_setid(struct table *t, const char *key, size_t sz_idx, uint64_t id) {
+	struct value tmp;
+	tmp.type = ST_ID;
+	tmp.v.id = id;
+	int type = _insert_table(t,key,sz_idx,&tmp);
+	return type != ST_ID && type != ST_NIL;
+}
+
+int
+stable_setinteger(struct table *t, const char *key, size_t sz_idx, int64_t i) {
+	struct value tmp;
+	tmp.type = ST_INTEGER;
+	tmp.v.i = i;
+	int type = _insert_table(t,key,sz_idx,&tmp);
+	return type != ST_INTEGER && type != ST_NIL;
+}
+
+#define RMW_ADD 0
+#define RMW_MIN 1
+#define RMW_MAX 2
+
+/*
+	Read-modify-write a number slot under the table lock, so concurrent
+	writers don't lose updates. A nil slot counts as 0 for add, and takes
+	v for min/max.
+ */
+static int
+_rmw_number(struct table *t, const char *key, size_t sz_idx, int op, double v, double *result) {
+	struct value tmp;
+	int r = 0;
+	if (t->frozen) {
+		if (result) {
+			*result = 0;
+		}
+		return 1;
+	}
+	t = _route(t, key, sz_idx);
+	_table_lock(t);
+	struct value *slot = _find_slot(t, key, sz_idx);
+	if (slot == NULL || slot->type == ST_NIL) {
+		tmp.type = ST_NUMBER;
+		tmp.v.n = v;
+		_insert_value(t, key, sz_idx, &tmp);
+	} else if (slot->type != ST_NUMBER) {
+		r = 1;
+	} else {
+		tmp.type = ST_NUMBER;
+		tmp.v.n = slot->v.n;
+		switch (op) {
+		case RMW_ADD:
+			tmp.v.n += v;
+			break;
+		case RMW_MIN:
+			if (v < tmp.v.n)
+				tmp.v.n = v;
+			break;
+		case RMW_MAX:
+			if (v > tmp.v.n)
+				tmp.v.n = v;
+			break;
+		}
+		if (tmp.v.n != slot->v.n) {
+			_write_value(slot, &tmp);
+		}
+	}
+	_table_unlock(t);
+	if (result) {
+		*result = r ? 0 : tmp.v.n;
+	}
+	return r;
+}
+
+int
+stable_addnumber(struct table *t, const char *key, size_t sz_idx, double delta, double *result) {
+	return _rmw_number(t, key, sz_idx, RMW_ADD, delta, result);
+}
+
+int
+stable_minnumber(struct table *t, const char *key, size_t sz_idx, double v, double *result) {
+	return _rmw_number(t, key, sz_idx, RMW_MIN, v, result);
+}
+
+int
+stable_maxnumber(struct table *t, const char *key, size_t sz_idx, double v, double *result) {
+	return _rmw_number(t, key, sz_idx, RMW_MAX, v, result);
+}
+
+int
+stable_addinteger(struct table *t, const char *key, size_t sz_idx, int64_t delta, int64_t *result) {
+	struct value tmp;
+	int r = 0;
+	if (t->frozen) {
+		if (result) {
+			*result = 0;
+		}
+		return 1;
+	}
+	t = _route(t, key, sz_idx);
+	_table_lock(t);
+	struct value *slot = _find_slot(t, key, sz_idx);
+	tmp.type = ST_INTEGER;
+	tmp.v.i = delta;
+	if (slot == NULL || slot->type == ST_NIL) {
+		_insert_value(t, key, sz_idx, &tmp);
+	} else if (slot->type != ST_INTEGER) {
+		r = 1;
+	} else {
+		tmp.v.i = (int64_t)((uint64_t)slot->v.i + (uint64_t)delta);
+		_write_value(slot, &tmp);
+	}
+	_table_unlock(t);
+	if (result) {
+		*result = r ? 0 : tmp.v.i;
+	}
+	return r;
+}
+
+static int
+_equal_value(int type, const struct value *slot, const union table_value *v) {
+	switch (type) {
+	case ST_NUMBER:
+		return slot->v.n == v->n;
+	case ST_BOOLEAN:
+		return !slot->v.b == !v->b;
+	case ST_ID:
+		return slot->v.id == v->id;
+	case ST_INTEGER:
+		return slot->v.i == v->i;
+	default:
+		return 0;
+	}
+}
+
+int
+stable_cas(struct table *t, const char *key, size_t sz_idx, int type, const union table_value *expect, const union table_value *v) {
+	int r = 0;
+	if (t->frozen) {
+		return 0;
+	}
+	t = _route(t, key, sz_idx);
+	_table_lock(t);
+	struct value *slot = _find_slot(t, key, sz_idx);
+	if (slot && slot->type == type && _equal_value(type, slot, expect)) {
+		struct value tmp;
+		tmp.type = type;
+		memcpy(&tmp.v, v, sizeof(tmp.v));
+		_write_value(slot, &tmp);
+		r = 1;
+	}
+	_table_unlock(t);
+	return r;
+}
+
+static void
+_new_string_value(struct context *ctx, struct value *v, const char *str, size_t sz) {
+	memset(v,0,sizeof(*v));
+	v->type = ST_STRING;
+	if (sz <= SHORT_STRING) {
+		memcpy(v->v.str, str, sz);
+		v->v.str[SHORT_TAG] = sz + 1;
+	} else {
+		struct string * s = _alloc(ctx, sizeof(*s));
+		s->ctx = ctx;
+		s->slot = _new_value_slot(ctx,str,sz);
+		v->v.s = s;
+	}
+}
+
+// for writers holding the table lock
+static int
+_set_string(struct table *t, const char *key, size_t sz_idx, const char * str, size_t sz) {
+	struct value *slot = _find_slot(t, key, sz_idx);
+	if (slot && slot->type == ST_STRING && !_short_string(slot)) {
+		_update_string(slot->v.s, str, sz);
+	} else if (slot && slot->type != ST_NIL && slot->type != ST_STRING) {
+		return 1;
+	} else {
+		struct value tmp;
+		_new_string_value(t->ctx, &tmp, str, sz);
+		if (slot && slot->type == ST_STRING) {
+			// short string updated in place
+			_write_value(slot, &tmp);
+		} else {
+			_insert_value(t, key, sz_idx, &tmp);
+		}
+	}
+	return 0;
+}
+
+int
+stable_setstring(struct table *t, const char *key, size_t sz_idx, const char * str, size_t sz) {
+	struct value tmp;
+	if (t->frozen) {
+		return 1;
+	}
+	t = _route(t, key, sz_idx);
+	_search_table(t,key,sz_idx,&tmp);
+	if (tmp.type == ST_STRING && !_short_string(&tmp)) {
+		// A long string stays long, swap the slot without the table lock
+		_update_string(tmp.v.s, str, sz);
+		return 0;
+	}
+	if (tmp.type != ST_NIL && tmp.type != ST_STRING) {
+		return 1;
+	}
+	_table_lock(t);
+	int r = _set_string(t, key, sz_idx, str, sz);
+	_table_unlock(t);
+
+	return r;
+}
+
+/*
+	Choose the array size for the integer keys of a batch like lua's
+	computesizes : the largest power of 2 that is more than half used.
+	Existing array slots are counted as if they were at the front.
+ */
+static size_t
+_batch_array_size(struct table *t, struct table_entry *e, size_t n) {
+	size_t nums[32];
+	size_t total = t->array_count;
+	int i;
+	memset(nums, 0, sizeof(nums));
+	nums[0] = t->array_count;
+	if (t->nums) {
+		// keys of the map part move to the array part too
+		for (i=0;i<ARRAY_BITS;i++) {
+			nums[i] += t->nums[i];
+			total += t->nums[i];
+		}
+	}
+	size_t j;
+	for (j=0;j<n;j++) {
+		if (e[j].key.key == NULL && e[j].key.sz_idx < MAX_ARRAY_SIZE) {
+			++nums[_index_bits(e[j].key.sz_idx)];
+			++total;
+		}
+	}
+	size_t a = 0;
+	size_t optimal = 0;
+	size_t twotoi = 1;
+	for (i=0;i<32 && twotoi / 2 < total;i++, twotoi *= 2) {
+		a += nums[i];
+		if (a > twotoi / 2) {
+			optimal = twotoi;
+		}
+	}
+	return optimal;
+}
+
+static void
+_reserve(struct table *t, struct table_entry *e, size_t n) {
+	size_t asize = _batch_array_size(t, e, n);
+	if (asize > (t->array ? t->array->size : 0)) {
+		_expand_array(t, asize - 1);
+	}
+	asize = t->array ? t->array->size : 0;
+	size_t need = t->map ? t->map->count : 0;
+	size_t i;
+	for (i=0;i<n;i++) {
+		if (e[i].key.key ? t->shard == NULL : e[i].key.sz_idx >= asize) {
+			++need;
+		}
+	}
+	if (need == 0) {
+		return;
+	}
+	size_t size = DEFAULT_SIZE;
+	while (size < need) {
+		size *= 2;
+	}
+	if (t->map == NULL) {
+		t->map = _create_hash(t->ctx, size);
+	} else if (t->map->size < size) {
+		STAT_INC(hash_expand);
+		_rehash(t, size, 0);
+	}
+}
+
+static int
+_set_entry(struct table *t, struct table_entry *e) {
+	const char *key = e->key.key;
+	size_t sz_idx = e->key.sz_idx;
+	struct value tmp;
+	switch (e->key.type) {
+	case ST_STRING:
+		return _set_string(t, key, sz_idx, e->v.p, e->sz);
+	case ST_TABLE: {
+		struct value *slot = _find_slot(t, key, sz_idx);
+		if (slot && slot->type == ST_TABLE) {
+			stable_release(slot->v.t);
+		}
+		break;
+	}
+	case ST_NIL:
+		return 0;
+	}
+	tmp.type = e->key.type;
+	memcpy(&tmp.v, &e->v, sizeof(tmp.v));
+	int type = _insert_value(t, key, sz_idx, &tmp);
+	return type != ST_NIL && type != e->key.type;
+}
+
+int
+stable_setbatch(struct table *t, struct table_entry *e, size_t n) {
+	int fail = 0;
+	size_t i;
+	if (t->frozen) {
+		for (i=0;i<n;i++) {
+			if (e[i].key.type != ST_NIL) {
+				e[i].key.type = ST_NIL;
+				++fail;
+			}
+		}
+		return fail;
+	}
+	if (t->shard) {
+		// string keys are set in their shards one by one
+		for (i=0;i<n;i++) {
+			if (e[i].key.key) {
+				fail += stable_setbatch(_route(t, e[i].key.key, e[i].key.sz_idx), &e[i], 1);
+			}
+		}
+	}
+	_table_lock(t);
+	_reserve(t, e, n);
+	for (i=0;i<n;i++) {
+		if (e[i].key.key && t->shard) {
+			continue;
+		}
+		if (_set_entry(t, &e[i])) {
+			e[i].key.type = ST_NIL;
+			++fail;
+		}
+	}
+	_table_unlock(t);
+	return fail;
+}
+
+/*
+	Write combining. stable_post pushes a copy of the entry to t->post, a
+	lock free stack, and the poster taking post_lock applies the whole stack
+	with one stable_setbatch, so the other posters never wait for the table
+	lock. Each round of _post_apply bumps post_taken before it takes the
+	stack, and sets post_done to it once applied : an entry pushed before
+	post_taken was read as T is applied by round T+1 at the latest, the
+	ticket of the entry.
+ */
+
+struct post {
+	struct post *next;
+	size_t size;
+	struct table_entry e;	// the key and the string are copied after the node
+};
+
+static void
+_post_free(struct context *ctx, struct post *p, struct table **pending) {
+	while (p) {
+		struct post *next = p->next;
+		if (p->e.key.type == ST_TABLE) {
+			struct value tmp;
+			tmp.type = ST_TABLE;
+			tmp.v.t = p->e.v.p;
+			_clear_value(&tmp, pending);
+		}
+		_free(ctx, p, p->size);
+		p = next;
+	}
+}
+
+static inline int
+_post_match(const struct table_key *a, const struct table_key *b) {
+	if (a->sz_idx != b->sz_idx) {
+		return 0;
+	}
+	if (a->key == NULL || b->key == NULL) {
+		return a->key == b->key;
+	}
+	return memcmp(a->key, b->key, a->sz_idx) == 0;
+}
+
+// Set the posted entries in order, only the last write of a key is kept.
+static void
+_post_batch(struct table *t, struct post *list) {
+	struct post *p = NULL;
+	size_t n = 0, i;
+	while (list) {
+		struct post *next = list->next;
+		list->next = p;
+		p = list;
+		list = next;
+		++n;
+	}
+	struct post **node = malloc(n * sizeof(*node));
+	struct table_entry *e = malloc(n * sizeof(*e));
+	size_t cap = DEFAULT_SIZE;
+	while (cap < n * 2) {
+		cap *= 2;
+	}
+	size_t *last = calloc(cap, sizeof(size_t));	// index + 1 of the last entry of a key
+	int coalesce = 0;
+	for (i=0;i<n;i++,p=p->next) {
+		node[i] = p;
+		e[i] = p->e;
+		size_t h = _hash_key(e[i].key.key, e[i].key.sz_idx) & (cap-1);
+		while (last[h] && !_post_match(&e[last[h]-1].key, &e[i].key)) {
+			h = (h + 1) & (cap-1);
+		}
+		if (last[h]) {
+			e[last[h]-1].key.type = ST_NIL;
+			++coalesce;
+		}
+		last[h] = i + 1;
+	}
+	stable_setbatch(t, e, n);
+	for (i=0;i<n;i++) {
+		// the reference of a table not set (coalesced or failed) is dropped
+		if (node[i]->e.key.type == ST_TABLE && e[i].key.type == ST_NIL) {
+			stable_release(node[i]->e.v.p);
+		}
+		_free(t->ctx, node[i], node[i]->size);
+	}
+	STAT_INC(post_batch);
+	STAT_ADD(post_coalesce, coalesce);
+	free(last);
+	free(e);
+	free(node);
+}
+
+static void
+_post_apply(struct table *t) {
+	for (;;) {
+		uint64_t round = __sync_add_and_fetch(&t->post_taken, 1);
+		struct post *list = __sync_lock_test_and_set(&t->post, NULL);
+		if (list) {
+			_post_batch(t, list);
+		}
+		__atomic_store_n(&t->post_done, round, __ATOMIC_RELEASE);
+		if (list == NULL) {
+			return;
+		}
+	}
+}
+
+// Apply the queue if nobody does, and wait for the round ticket (0 doesn't wait).
+static void
+_post_combine(struct table *t, uint64_t ticket) {
+	for (;;) {
+		if (__sync_lock_test_and_set(&t->post_lock, 1) == 0) {
+			_post_apply(t);
+			__sync_lock_release(&t->post_lock);
+			__sync_synchronize();
+			// an entry pushed while the lock was held has no applier yet
+			if (__atomic_load_n(&t->post, __ATOMIC_SEQ_CST) == NULL) {
+				return;
+			}
+		} else if (__atomic_load_n(&t->post_done, __ATOMIC_ACQUIRE) >= ticket) {
+			return;
+		} else {
+			STAT_INC(lock_spin);
+		}
+	}
+}
+
+uint64_t
+stable_post(struct table *t, const struct table_entry *e) {
+	size_t ksz = e->key.key ? e->key.sz_idx : 0;
+	size_t vsz = e->key.type == ST_STRING ? e->sz : 0;
+	size_t size = sizeof(struct post) + ksz + vsz;
+	struct post *p = _alloc(t->ctx, size);
+	char *buf = (char *)(p+1);
+	p->size = size;
+	p->e = *e;
+	if (e->key.key) {
+		memcpy(buf, e->key.key, ksz);
+		p->e.key.key = buf;
+	}
+	if (e->key.type == ST_STRING) {
+		memcpy(buf + ksz, e->v.p, vsz);
+		p->e.v.p = buf + ksz;
+	}
+	struct post *head;
+	do {
+		head = t->post;
+		p->next = head;
+	} while (!__sync_bool_compare_and_swap(&t->post, head, p));
+	uint64_t ticket = __atomic_load_n(&t->post_taken, __ATOMIC_SEQ_CST) + 1;
+	_post_combine(t, 0);
+	return ticket;
+}
+
+void
+stable_sync(struct table *t, uint64_t ticket) {
+	if (ticket == 0) {
+		ticket = __atomic_load_n(&t->post_taken, __ATOMIC_SEQ_CST) + 1;
+	}
+	_post_combine(t, ticket);
+}
+
+static void
+_publish(struct table *t) {
+	if (!t->detached) {
+		return;
+	}
+	t->detached = 0;
+	if (t->frozen) {
+		struct frozen *f = t->frozen;
+		uint32_t i;
+		for (i=0;i<f->narray + f->nslot;i++) {
+			struct value *v = _frozen_value(f, i);
+			if (v->type == ST_TABLE && v->v.t) {
+				_publish(v->v.t);
+			}
+		}
+	}
+	if (t->shard) {
+		int i;
+		for (i=0;i<(1<<t->shard_bits);i++) {
+			_publish(t->shard[i]);
+		}
+	}
+	if (t->array) {
+		struct array *a = t->array;
+		int i;
+		for (i=0;i<a->size;i++) {
+			struct value *v = _array_slot(a, i);
+			if (v->type == ST_TABLE) {
+				_publish(v->v.t);
+			}
+		}
+	}
+	if (t->map) {
+		struct map *m = t->map;
+		int i;
+		for (i=0;i<m->size;i++) {
+			struct node *n;
+			for (n = m->n[i]; n; n = n->next) {
+				if (n->v.type == ST_TABLE) {
+					_publish(n->v.v.t);
+				}
+			}
+		}
+	}
+}
+
+int
+stable_swap_table(struct table *parent, const char *key, size_t sz_idx, struct table *t, struct table **old) {
+	struct value tmp;
+	int r = 0;
+	*old = NULL;
+	if (parent->frozen) {
+		return 1;
+	}
+	parent = _route(parent, key, sz_idx);
+	_publish(t);
+	// the whole tree must be visible before the pointer to it
+	__sync_synchronize();
+	tmp.type = ST_TABLE;
+	tmp.v.t = t;
+	_table_lock(parent);
+	struct value *slot = _find_slot(parent, key, sz_idx);
+	if (slot == NULL || slot->type == ST_NIL) {
+		_insert_value(parent, key, sz_idx, &tmp);
+	} else if (slot->type == ST_TABLE) {
+		*old = slot->v.t;
+		_write_value(slot, &tmp);
+	} else {
+		r = 1;
+	}
+	_table_unlock(parent);
+	return r;
+}
+
+size_t 
+stable_cap(struct table *t) {
+	size_t s = 0;
+	if (t->frozen) {
+		return t->frozen->narray + t->frozen->nslot;
+	}
+	if (t->shard) {
+		int i;
+		for (i=0;i<(1<<t->shard_bits);i++) {
+			s += stable_cap(t->shard[i]);
+		}
+	}
+	if (t->array) {
+		struct array * a = _grab_array(t);
+		s += a->size;
+		_release_array(t->ctx, a);
+	}
+	if (t->map) {
+		struct map * m = _grab_map(t);
+		s += m->count;
+		_release_map(t->ctx, m);
+	}
+	return s;
+}
+
+void
+stable_size(struct table *t, size_t *array, size_t *hash) {
+	if (t->frozen) {
+		struct frozen *f = t->frozen;
+		uint32_t i;
+		*array = 0;
+		for (i=0;i<f->narray;i++) {
+			if (f->array[i].type != ST_NIL) {
+				++*array;
+			}
+		}
+		*hash = f->nslot;
+		return;
+	}
+	*array = t->array_count;
+	*hash = 0;
+	if (t->map) {
+		struct map * m = _grab_map(t);
+		*hash = m->count;
+		_release_map(t->ctx, m);
+	}
+	if (t->shard) {
+		int i;
+		for (i=0;i<(1<<t->shard_bits);i++) {
+			size_t sa, sh;
+			stable_size(t->shard[i], &sa, &sh);
+			*hash += sh;
+		}
+	}
+}
+
+size_t
+stable_foreach(struct table *t, table_foreach_func func, void *ud) {
+	size_t count = 0;
+	struct table_key k;
+	struct value tmp;
+	if (t->frozen) {
+		struct frozen *f = t->frozen;
+		uint32_t i;
+		for (i=0;i<f->narray + f->nslot;i++) {
+			tmp = *_frozen_value(f, i);
+			if (tmp.type == ST_NIL) {
+				continue;
+			}
+			k.type = tmp.type;
+			if (i < f->narray) {
+				k.key = NULL;
+				k.sz_idx = i;
+			} else {
+				k.key = f->slot[i - f->narray].key;
+				k.sz_idx = f->slot[i - f->narray].sz_idx;
+			}
+			func(ud, &k, (union table_value *)&tmp.v);
+			++count;
+		}
+		return count;
+	}
+	if (t->array) {
+		struct array * a = _grab_array(t);
+		int i;
+		for (i=0;i<a->size;i++) {
+			_read_value(&tmp, _array_slot(a, i));
+			if (tmp.type == ST_NIL) {
+				continue;
+			}
+			k.type = tmp.type;
+			k.key = NULL;
+			k.sz_idx = i;
+			func(ud, &k, (union table_value *)&tmp.v);
+			++count;
+		}
+		_release_array(t->ctx, a);
+	}
+	if (t->map) {
+		struct map * m = _grab_map(t);
+		int i;
+		for (i=0;i<m->size;i++) {
+			struct node * n;
+			for (n = m->n[i]; n; n = n->next) {
+				_read_value(&tmp, &n->v);
+				if (tmp.type == ST_NIL) {
+					continue;
+				}
+				k.type = tmp.type;
+				if (n->k) {
+					k.key = n->k->buf;
+					k.sz_idx = n->k->sz;
+				} else {
+					k.key = NULL;
+					k.sz_idx = n->idx;
+				}
+				func(ud, &k, (union table_value *)&tmp.v);
+				++count;
+			}
+		}
+		_release_map(t->ctx, m);
+	}
+	if (t->shard) {
+		int i;
+		for (i=0;i<(1<<t->shard_bits);i++) {
+			count += stable_foreach(t->shard[i], func, ud);
+		}
+	}
+	return count;
+}
+
+/*
+	Number kernels. The slots of an array are tagged and seqlocked, so
+	_scan copies the numbers of a block into a plain double buffer first
+	(integers converted, NAN for other types), and the kernels are branch
+	free loops over contiguous doubles, with no tag check or seqlock inside.
+	They are scalar code : without -ffast-math the compiler doesn't reorder
+	the floating point reductions, so build with -O2 (the Makefile does for
+	stable.so).
+ */
+
+typedef int (*scan_func)(void *ud, const double *v, size_t n, size_t base);
+
+static inline double
+_scan_number(const struct value *v) {
+	switch (v->type) {
+	case ST_NUMBER:
+		return v->v.n;
+	case ST_INTEGER:
+		return (double)v->v.i;
+	default:
+		return NAN;
+	}
+}
+
+struct scan_key {
+	size_t idx;
+	double v;
+};
+
+static int
+_by_index(const void *a, const void *b) {
+	size_t x = ((const struct scan_key *)a)->idx;
+	size_t y = ((const struct scan_key *)b)->idx;
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static size_t
+_scan_nodes(struct map *m, size_t from, size_t to, struct scan_key *key, size_t cap) {
+	size_t n = 0;
+	int i;
+	for (i=0;i<m->size;i++) {
+		struct node *node;
+		for (node = m->n[i]; node; node = node->next) {
+			if (node->k == NULL && node->idx >= from && node->idx < to) {
+				if (key) {
+					if (n == cap) {
+						// inserted after the count
+						return n;
+					}
+					struct value tmp;
+					_read_value(&tmp, &node->v);
+					key[n].idx = node->idx;
+					key[n].v = _scan_number(&tmp);
+				}
+				++n;
+			}
+		}
+	}
+	return n;
+}
+
+/*
+	The integer keys out of the array part are collected (from the map nodes
+	or the frozen slots), sorted, and each run of consecutive indexes is
+	passed as a block.
+ */
+static void
+_scan_sorted(struct scan_key *key, size_t n, scan_func f, void *ud) {
+	double buf[SCAN_BLOCK];
+	qsort(key, n, sizeof(*key), _by_index);
+	size_t i = 0;
+	while (i < n) {
+		size_t base = key[i].idx;
+		size_t j = 0;
+		do {
+			buf[j] = key[i+j].v;
+			++j;
+		} while (j < SCAN_BLOCK && i+j < n && key[i+j].idx == base + j);
+		if (f(ud, buf, j, base)) {
+			return;
+		}
+		i += j;
+	}
+}
+
+static void
+_scan_map(struct table *t, size_t from, size_t to, scan_func f, void *ud) {
+	struct map *m = _grab_map(t);
+	size_t n = _scan_nodes(m, from, to, NULL, 0);
+	struct scan_key *key = n ? malloc(n * sizeof(*key)) : NULL;
+	if (key) {
+		n = _scan_nodes(m, from, to, key, n);
+	}
+	_release_map(t->ctx, m);
+	if (key) {
+		_scan_sorted(key, n, f, ud);
+		free(key);
+	}
+}
+
+static void
+_scan_frozen(struct frozen *fr, size_t from, size_t to, scan_func f, void *ud) {
+	size_t n = 0;
+	uint32_t i;
+	for (i=0;i<fr->nslot;i++) {
+		struct frozen_slot *s = &fr->slot[i];
+		n += s->key == NULL && s->sz_idx >= from && s->sz_idx < to;
+	}
+	if (n == 0) {
+		return;
+	}
+	struct scan_key *key = malloc(n * sizeof(*key));
+	n = 0;
+	for (i=0;i<fr->nslot;i++) {
+		struct frozen_slot *s = &fr->slot[i];
+		if (s->key == NULL && s->sz_idx >= from && s->sz_idx < to) {
+			key[n].idx = s->sz_idx;
+			key[n].v = _scan_number(&s->v);
+			++n;
+		}
+	}
+	_scan_sorted(key, n, f, ud);
+	free(key);
+}
+
+static void
+_scan(struct table *t, size_t from, size_t to, scan_func f, void *ud) {
+	double buf[SCAN_BLOCK];
+	struct value tmp;
+	size_t i = from;
+	size_t j, n;
+	if (t->frozen) {
+		struct frozen *fr = t->frozen;
+		size_t end = to < fr->narray ? to : fr->narray;
+		while (i < end) {
+			n = end - i < SCAN_BLOCK ? end - i : SCAN_BLOCK;
+			for (j=0;j<n;j++) {
+				buf[j] = _scan_number(&fr->array[i+j]);
+			}
+			if (f(ud, buf, n, i)) {
+				return;
+			}
+			i += n;
+		}
+		if (i < to) {
+			_scan_frozen(fr, i, to, f, ud);
+		}
+		return;
+	}
+	if (t->array && i < to) {
+		// one pinned generation for the array part
+		struct array *a = _grab_array(t);
+		size_t end = to < a->size ? to : a->size;
+		while (i < end) {
+			n = end - i < SCAN_BLOCK ? end - i : SCAN_BLOCK;
+			for (j=0;j<n;j++) {
+				_read_value(&tmp, _array_slot(a, i+j));
+				buf[j] = _scan_number(&tmp);
+			}
+			if (f(ud, buf, n, i)) {
+				_release_array(t->ctx, a);
+				return;
+			}
+			i += n;
+		}
+		_release_array(t->ctx, a);
+	}
+	if (t->map_index == 0) {
+		return;
+	}
+	if (i < to) {
+		_scan_map(t, i, to, f, ud);
+	}
+}
+
+struct scan_sum {
+	double sum;
+	size_t count;
+};
+
+static int
+_kernel_sum(void *ud, const double *v, size_t n, size_t base) {
+	struct scan_sum *s = ud;
+	double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+	size_t c0 = 0, c1 = 0, c2 = 0, c3 = 0;
+	size_t i;
+	for (i=0;i+4<=n;i+=4) {
+		s0 += v[i] == v[i] ? v[i] : 0;
+		s1 += v[i+1] == v[i+1] ? v[i+1] : 0;
+		s2 += v[i+2] == v[i+2] ? v[i+2] : 0;
+		s3 += v[i+3] == v[i+3] ? v[i+3] : 0;
+		c0 += v[i] == v[i];
+		c1 += v[i+1] == v[i+1];
+		c2 += v[i+2] == v[i+2];
+		c3 += v[i+3] == v[i+3];
+	}
+	for (;i<n;i++) {
+		s0 += v[i] == v[i] ? v[i] : 0;
+		c0 += v[i] == v[i];
+	}
+	s->sum += (s0 + s1) + (s2 + s3);
+	s->count += c0 + c1 + c2 + c3;
+	return 0;
+}
+
+double
+stable_sum(struct table *t, size_t from, size_t to, size_t *count) {
+	struct scan_sum s = { 0, 0 };
+	_scan(t, from, to, _kernel_sum, &s);
+	if (count) {
+		*count = s.count;
+	}
+	return s.sum;
+}
+
+struct scan_minmax {
+	double min;
+	double max;
+};
+
+static int
+_kernel_minmax(void *ud, const double *v, size_t n, size_t base) {
+	struct scan_minmax *m = ud;
+	double min = m->min;
+	double max = m->max;
+	size_t i;
+	for (i=0;i<n;i++) {
+		// NAN compares false, so it's skipped
+		min = v[i] < min ? v[i] : min;
+		max = v[i] > max ? v[i] : max;
+	}
+	m->min = min;
+	m->max = max;
+	return 0;
+}
+
+int
+stable_minmax(struct table *t, size_t from, size_t to, double *min, double *max) {
+	struct scan_minmax m = { INFINITY, -INFINITY };
+	_scan(t, from, to, _kernel_minmax, &m);
+	*min = m.min;
+	*max = m.max;
+	return m.min <= m.max;
+}
+
+struct scan_compare {
+	int op;
+	double v;
+	size_t count;
+	size_t first;
+	int found;
+};
+
+// 1 for each number matching op v, 0 for others (NAN)
+static inline int
+_match(int op, double x, double v) {
+	switch (op) {
+	case ST_LT: return x < v;
+	case ST_LE: return x <= v;
+	case ST_EQ: return x == v;
+	case ST_NE: return x != v && x == x;
+	case ST_GE: return x >= v;
+	case ST_GT: return x > v;
+	}
+	return 0;
+}
+
+static int
+_kernel_count(void *ud, const double *v, size_t n, size_t base) {
+	struct scan_compare *c = ud;
+	size_t count = 0;
+	size_t i;
+	double x = c->v;
+	// one loop per op, so each is a plain compare loop
+	switch (c->op) {
+	case ST_LT: for (i=0;i<n;i++) count += v[i] < x; break;
+	case ST_LE: for (i=0;i<n;i++) count += v[i] <= x; break;
+	case ST_EQ: for (i=0;i<n;i++) count += v[i] == x; break;
+	case ST_NE: for (i=0;i<n;i++) count += v[i] != x && v[i] == v[i]; break;
+	case ST_GE: for (i=0;i<n;i++) count += v[i] >= x; break;
+	case ST_GT: for (i=0;i<n;i++) count += v[i] > x; break;
+	}
+	c->count += count;
+	return 0;
+}
+
+size_t
+stable_count_if(struct table *t, size_t from, size_t to, int op, double v) {
+	struct scan_compare c = { op, v, 0, 0, 0 };
+	_scan(t, from, to, _kernel_count, &c);
+	return c.count;
+}
+
+static int
+_kernel_find(void *ud, const double *v, size_t n, size_t base) {
+	struct scan_compare *c = ud;
+	size_t i;
+	for (i=0;i<n;i++) {
+		if (_match(c->op, v[i], c->v)) {
+			c->first = base + i;
+			c->found = 1;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int
+stable_find_first(struct table *t, size_t from, size_t to, int op, double v, size_t *idx) {
+	struct scan_compare c = { op, v, 0, 0, 0 };
+	_scan(t, from, to, _kernel_find, &c);
+	*idx = c.first;
+	return c.found;
+}
+
+int
+stable_stats(struct stable_stats *st) {
+	memset(st, 0, sizeof(*st));
+#ifdef STABLE_STATS
+	struct stat_counter *c;
+	for (c = S_head; c; c = c->next) {
+		struct stable_stats *s = &c->s;
+		st->map_retry += s->map_retry;
+		st->array_retry += s->array_retry;
+		st->lock_spin += s->lock_spin;
+		st->grab_spin += s->grab_spin;
+		st->hash_expand += s->hash_expand;
+		st->array_expand += s->array_expand;
+		st->lookup += s->lookup;
+		st->probe += s->probe;
+		if (s->probe_max > st->probe_max) {
+			st->probe_max = s->probe_max;
+		}
+		st->map_live += s->map_live;
+		st->array_live += s->array_live;
+		st->gc_run += s->gc_run;
+		st->gc_scan += s->gc_scan;
+		st->gc_collect += s->gc_collect;
+		st->post_batch += s->post_batch;
+		st->post_coalesce += s->post_coalesce;
+		st->string_inplace += s->string_inplace;
+	}
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+size_t 
+stable_keys(struct table *t, struct table_key *vv, size_t cap) {
+	size_t count = 0;
+	if (t->frozen) {
+		struct frozen *f = t->frozen;
+		uint32_t i;
+		for (i=0;i<f->narray + f->nslot && count < cap;i++) {
+			struct value *v = _frozen_value(f, i);
+			if (v->type == ST_NIL) {
+				continue;
+			}
+			vv[count].type = v->type;
+			if (i < f->narray) {
+				vv[count].key = NULL;
+				vv[count].sz_idx = i;
+			} else {
+				vv[count].key = f->slot[i - f->narray].key;
+				vv[count].sz_idx = f->slot[i - f->narray].sz_idx;
+			}
+			++count;
+		}
+		return count;
+	}
+	if (t->array) {
+		struct array * a = _grab_array(t);
+		int i;
+		for (i=0;i<a->size;i++) {
+			if (count>=cap) {
+				_release_array(t->ctx, a);
+				return count;
+			}
+			struct value *v = _array_slot(a, i);
+			if (v->type == ST_NIL) {
+				continue;
+			}
+			vv[count].type = v->type;
+			vv[count].key = NULL;
+			vv[count].sz_idx = i;
+			++count;
+		}
+		_release_array(t->ctx, a);
+	}
+	if (t->map) {
+		struct map * m = _grab_map(t);
+		int i;
+		for (i=0;i<m->size;i++) {
+			struct node * n =  m->n[i];
+			while (n) {
+				if (count>=cap) {
+					_release_map(t->ctx, m);
+					return count;
+				}
+				vv[count].type = n->v.type;
+				if (n->k) {
+					vv[count].key = n->k->buf;
+					vv[count].sz_idx = n->k->sz;
+				} else {
+					vv[count].key = NULL;
+					vv[count].sz_idx = n->idx;
+				}
+				++count;
+				n=n->next;
+			}
+		}
+		_release_map(t->ctx, m);
+	}
+	if (t->shard) {
+		int i;
+		for (i=0;i<(1<<t->shard_bits);i++) {
+			count += stable_keys(t->shard[i], vv + count, cap - count);
+		}
+	}
+	return count;
+}
+
+/*
+	MessagePack. A table is encoded as a map, integer keys as integers (0
+	based, as in C), ids as ext type MSGPACK_ID. The encoder holds the array
+	and map generations of each table while it counts and writes its
+	entries, and a slot never goes back to nil, so writing the first count
+	non nil entries gives a map of the announced size even if writers run.
+	Output is buffered in struct encoder (on the stack) and given to the
+	writer in chunks of at most ENCODE_BUFFER bytes.
+ */
+
+#define ENCODE_BUFFER 4096
+#define ENCODE_DEPTH 64
+#define MSGPACK_ID 1
+
+struct encoder {
+	table_setstring_func writer;
+	void *ud;
+	size_t n;
+	char buf[ENCODE_BUFFER];
+};
+
+static void
+_enc_flush(struct encoder *e) {
+	if (e->n) {
+		e->writer(e->ud, e->buf, e->n);
+		e->n = 0;
+	}
+}
+
+static void
+_enc_write(void *ud, const char *p, size_t sz) {
+	struct encoder *e = ud;
+	if (e->n + sz > ENCODE_BUFFER) {
+		_enc_flush(e);
+		if (sz > ENCODE_BUFFER) {
+			e->writer(e->ud, p, sz);
+			return;
+		}
+	}
+	memcpy(e->buf + e->n, p, sz);
+	e->n += sz;
+}
+
+static inline void
+_enc_be(char *p, uint64_t v, int n) {
+	int i;
+	for (i=0;i<n;i++) {
+		p[n-1-i] = (char)(v >> (i*8));
+	}
+}
+
+// tag followed by the big endian n bytes of v
+static void
+_enc_tag(struct encoder *e, uint8_t tag, uint64_t v, int n) {
+	char tmp[9];
+	tmp[0] = tag;
+	_enc_be(tmp+1, v, n);
+	_enc_write(e, tmp, n+1);
+}
+
+static void
+_enc_integer(struct encoder *e, int64_t i) {
+	if (i >= 0) {
+		if (i < 128) {
+			_enc_tag(e, (uint8_t)i, 0, 0);
+		} else if (i <= 0xff) {
+			_enc_tag(e, 0xcc, i, 1);
+		} else if (i <= 0xffff) {
+			_enc_tag(e, 0xcd, i, 2);
+		} else if (i <= 0xffffffffLL) {
+			_enc_tag(e, 0xce, i, 4);
+		} else {
+			_enc_tag(e, 0xcf, i, 8);
+		}
+	} else if (i >= -32) {
+		_enc_tag(e, (uint8_t)i, 0, 0);
+	} else if (i >= INT8_MIN) {
+		_enc_tag(e, 0xd0, (uint64_t)i, 1);
+	} else if (i >= INT16_MIN) {
+		_enc_tag(e, 0xd1, (uint64_t)i, 2);
+	} else if (i >= INT32_MIN) {
+		_enc_tag(e, 0xd2, (uint64_t)i, 4);
+	} else {
+		_enc_tag(e, 0xd3, (uint64_t)i, 8);
+	}
+}
+
+static void
+_enc_string(void *ud, const char *str, size_t sz) {
+	struct encoder *e = ud;
+	if (sz < 32) {
+		_enc_tag(e, 0xa0 | (uint8_t)sz, 0, 0);
+	} else if (sz <= 0xff) {
+		_enc_tag(e, 0xd9, sz, 1);
+	} else if (sz <= 0xffff) {
+		_enc_tag(e, 0xda, sz, 2);
+	} else {
+		_enc_tag(e, 0xdb, sz, 4);
+	}
+	_enc_write(e, str, sz);
+}
+
+static void
+_enc_map(struct encoder *e, size_t n) {
+	if (n < 16) {
+		_enc_tag(e, 0x80 | (uint8_t)n, 0, 0);
+	} else if (n <= 0xffff) {
+		_enc_tag(e, 0xde, n, 2);
+	} else {
+		_enc_tag(e, 0xdf, n, 4);
+	}
+}
+
+static int _enc_table(struct encoder *e, struct table *t, int depth);
+
+static int
+_enc_value(struct encoder *e, struct value *v, int depth) {
+	switch (v->type) {
+	case ST_NUMBER: {
+		union { double d; uint64_t u; } u;
+		u.d = v->v.n;
+		_enc_tag(e, 0xcb, u.u, 8);
+		break;
+	}
+	case ST_INTEGER:
+		_enc_integer(e, v->v.i);
+		break;
+	case ST_BOOLEAN:
+		_enc_tag(e, v->v.b ? 0xc3 : 0xc2, 0, 0);
+		break;
+	case ST_ID: {
+		// fixext 8
+		char tmp[10];
+		tmp[0] = (char)0xd7;
+		tmp[1] = MSGPACK_ID;
+		_enc_be(tmp+2, v->v.id, 8);
+		_enc_write(e, tmp, 10);
+		break;
+	}
+	case ST_STRING:
+		stable_value_string((union table_value *)&v->v, _enc_string, e);
+		break;
+	case ST_TABLE:
+		if (v->v.t == NULL) {
+			_enc_tag(e, 0xc0, 0, 0);
+		} else {
+			return _enc_table(e, v->v.t, depth + 1);
+		}
+		break;
+	}
+	return 0;
+}
+
+static size_t
+_enc_count_array(struct array *a) {
+	size_t n = 0;
+	int i;
+	for (i=0;i<a->size;i++) {
+		if (__atomic_load_n(&_array_slot(a, i)->type, __ATOMIC_ACQUIRE) != ST_NIL) {
+			++n;
+		}
+	}
+	return n;
+}
+
+// the integer keys below asize are in the array part already (moved by an expansion)
+static inline int
+_enc_moved(struct node *n, size_t asize) {
+	return n->k == NULL && n->idx < asize;
+}
+
+static size_t
+_enc_count_map(struct map *m, size_t asize) {
+	size_t n = 0;
+	int i;
+	for (i=0;i<m->size;i++) {
+		struct node *node;
+		for (node = m->n[i]; node; node = node->next) {
+			if (!_enc_moved(node, asize)) {
+				++n;
+			}
+		}
+	}
+	return n;
+}
+
+static int
+_enc_array(struct encoder *e, struct array *a, size_t *left, int depth) {
+	struct value tmp;
+	int i;
+	for (i=0;i<a->size && *left > 0;i++) {
+		_read_value(&tmp, _array_slot(a, i));
+		if (tmp.type == ST_NIL) {
+			continue;
+		}
+		_enc_integer(e, i);
+		if (_enc_value(e, &tmp, depth)) {
+			return 1;
+		}
+		--*left;
+	}
+	return 0;
+}
+
+static int
+_enc_nodes(struct encoder *e, struct map *m, size_t asize, size_t *left, int depth) {
+	struct value tmp;
+	int i;
+	for (i=0;i<m->size;i++) {
+		struct node *n;
+		for (n = m->n[i]; n && *left > 0; n = n->next) {
+			if (_enc_moved(n, asize)) {
+				continue;
+			}
+			_read_value(&tmp, &n->v);
+			if (n->k) {
+				_enc_string(e, n->k->buf, n->k->sz);
+			} else {
+				_enc_integer(e, n->idx);
+			}
+			if (_enc_value(e, &tmp, depth)) {
+				return 1;
+			}
+			--*left;
+		}
+	}
+	return 0;
+}
+
+static int
+_enc_frozen(struct encoder *e, struct frozen *f, int depth) {
+	size_t n = 0;
+	uint32_t i;
+	for (i=0;i<f->narray + f->nslot;i++) {
+		if (_frozen_value(f, i)->type != ST_NIL) {
+			++n;
+		}
+	}
+	_enc_map(e, n);
+	for (i=0;i<f->narray + f->nslot;i++) {
+		struct value *v = _frozen_value(f, i);
+		if (v->type == ST_NIL) {
+			continue;
+		}
+		if (i < f->narray) {
+			_enc_integer(e, i);
+		} else if (f->slot[i - f->narray].key) {
+			_enc_string(e, f->slot[i - f->narray].key, f->slot[i - f->narray].sz_idx);
+		} else {
+			_enc_integer(e, f->slot[i - f->narray].sz_idx);
+		}
+		if (_enc_value(e, v, depth)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int
+_enc_table(struct encoder *e, struct table *t, int depth) {
+	if (depth > ENCODE_DEPTH) {
+		return 1;
+	}
+	if (t->frozen) {
+		return _enc_frozen(e, t->frozen, depth);
+	}
+	/*
+		_expand_array publishes the new array before the map without the
+		moved keys. So the map is grabbed first : the array grabbed after is
+		as new, and has the keys of the map below its size, or they are
+		still in the map. (The other way round, an old array and a new map
+		both miss them.)
+	 */
+	struct map *m = t->map ? _grab_map(t) : NULL;
+	struct array *a = t->array ? _grab_array(t) : NULL;
+	size_t asize = a ? a->size : 0;
+	size_t n = 0;
+	int i;
+	if (a) {
+		n += _enc_count_array(a);
+	}
+	if (m) {
+		n += _enc_count_map(m, asize);
+	}
+	// shards only have string keys, a key never leaves a map, so a later generation has them all
+	if (t->shard) {
+		for (i=0;i<(1<<t->shard_bits);i++) {
+			struct table *s = t->shard[i];
+			if (s->map) {
+				struct map *sm = _grab_map(s);
+				n += _enc_count_map(sm, 0);
+				_release_map(s->ctx, sm);
+			}
+		}
+	}
+	_enc_map(e, n);
+	int r = 0;
+	if (a) {
+		r = _enc_array(e, a, &n, depth);
+		_release_array(t->ctx, a);
+	}
+	if (m) {
+		if (r == 0) {
+			r = _enc_nodes(e, m, asize, &n, depth);
+		}
+		_release_map(t->ctx, m);
+	}
+	if (t->shard) {
+		for (i=0;i<(1<<t->shard_bits) && r == 0;i++) {
+			struct table *s = t->shard[i];
+			if (s->map) {
+				struct map *sm = _grab_map(s);
+				r = _enc_nodes(e, sm, 0, &n, depth);
+				_release_map(s->ctx, sm);
+			}
+		}
+	}
+	return r;
+}
+
+int
+stable_encode_msgpack(struct table *t, table_setstring_func writer, void *ud) {
+	struct encoder e;
+	e.writer = writer;
+	e.ud = ud;
+	e.n = 0;
+	int r = _enc_table(&e, t, 0);
+	_enc_flush(&e);
+	return r;
+}
+
+/*
+	The decoder builds each map with one stable_setbatch, so tables are
+	presized. Keys and strings point into buf until the batch copies them.
+ */
+
+struct decoder {
+	const uint8_t *p;
+	const uint8_t *end;
+};
+
+// A table entry not set by stable_setbatch is released, its sz is TABLE_MARK
+#define TABLE_MARK ((size_t)-1)
+
+static int
+_dec_uint(struct decoder *d, int n, uint64_t *v) {
+	if (d->end - d->p < n) {
+		return 1;
+	}
+	uint64_t r = 0;
+	int i;
+	for (i=0;i<n;i++) {
+		r = r << 8 | d->p[i];
+	}
+	d->p += n;
+	*v = r;
+	return 0;
+}
+
+static int
+_dec_bytes(struct decoder *d, uint64_t sz, struct table_entry *e) {
+	if (sz > (uint64_t)(d->end - d->p)) {
+		return 1;
+	}
+	e->key.type = ST_STRING;
+	e->v.p = (void *)d->p;
+	e->sz = sz;
+	d->p += sz;
+	return 0;
+}
+
+// a string (or bin) with an n bytes length
+static int
+_dec_string(struct decoder *d, int n, struct table_entry *e) {
+	uint64_t sz;
+	if (_dec_uint(d, n, &sz)) {
+		return 1;
+	}
+	return _dec_bytes(d, sz, e);
+}
+
+static struct table * _dec_table(struct decoder *d, struct table *parent, size_t n, int array, int depth);
+
+static int
+_dec_child(struct decoder *d, struct table *parent, int n, int array, struct table_entry *e, int depth) {
+	uint64_t count = n;
+	if (n < 0 && _dec_uint(d, -n, &count)) {
+		return 1;
+	}
+	struct table *t = _dec_table(d, parent, count, array, depth + 1);
+	if (t == NULL) {
+		return 1;
+	}
+	e->key.type = ST_TABLE;
+	e->v.p = t;
+	e->sz = TABLE_MARK;
+	return 0;
+}
+
+// Decode one value, its type goes to e->key.type
+static int
+_dec_value(struct decoder *d, struct table *parent, struct table_entry *e, int depth) {
+	if (d->p >= d->end) {
+		return 1;
+	}
+	uint8_t c = *d->p++;
+	uint64_t u;
+	e->sz = 0;
+	if (c <= 0x7f || c >= 0xe0) {
+		// positive or negative fixint
+		e->key.type = ST_INTEGER;
+		e->v.i = (int8_t)c;
+		return 0;
+	}
+	if ((c & 0xe0) == 0xa0) {
+		return _dec_bytes(d, c & 0x1f, e);
+	}
+	switch (c & 0xf0) {
+	case 0x80:
+		return _dec_child(d, parent, c & 0x0f, 0, e, depth);
+	case 0x90:
+		return _dec_child(d, parent, c & 0x0f, 1, e, depth);
+	}
+	switch (c) {
+	case 0xc0:
+		e->key.type = ST_NIL;
+		return 0;
+	case 0xc2:
+	case 0xc3:
+		e->key.type = ST_BOOLEAN;
+		e->v.b = c & 1;
+		return 0;
+	case 0xcc: case 0xcd: case 0xce: case 0xcf:
+		if (_dec_uint(d, 1 << (c - 0xcc), &u)) {
+			return 1;
+		}
+		if (u > INT64_MAX) {
+			e->key.type = ST_NUMBER;
+			e->v.n = (double)u;
+		} else {
+			e->key.type = ST_INTEGER;
+			e->v.i = (int64_t)u;
+		}
+		return 0;
+	case 0xd0: case 0xd1: case 0xd2: case 0xd3: {
+		int n = 1 << (c - 0xd0);
+		if (_dec_uint(d, n, &u)) {
+			return 1;
+		}
+		int shift = 64 - n * 8;
+		e->key.type = ST_INTEGER;
+		e->v.i = (int64_t)(u << shift) >> shift;
+		return 0;
+	}
+	case 0xca: {
+		union { float f; uint32_t u; } f;
+		if (_dec_uint(d, 4, &u)) {
+			return 1;
+		}
+		f.u = (uint32_t)u;
+		e->key.type = ST_NUMBER;
+		e->v.n = f.f;
+		return 0;
+	}
+	case 0xcb:
+		if (_dec_uint(d, 8, &e->v.id)) {
+			return 1;
+		}
+		e->key.type = ST_NUMBER;	// same bits as the id
+		return 0;
+	case 0xd9: case 0xc4:
+		return _dec_string(d, 1, e);
+	case 0xda: case 0xc5:
+		return _dec_string(d, 2, e);
+	case 0xdb: case 0xc6:
+		return _dec_string(d, 4, e);
+	case 0xdc:
+		return _dec_child(d, parent, -2, 1, e, depth);
+	case 0xdd:
+		return _dec_child(d, parent, -4, 1, e, depth);
+	case 0xde:
+		return _dec_child(d, parent, -2, 0, e, depth);
+	case 0xdf:
+		return _dec_child(d, parent, -4, 0, e, depth);
+	case 0xd7:
+		if (d->p >= d->end || *d->p != MSGPACK_ID) {
+			return 1;
+		}
+		++d->p;
+		if (_dec_uint(d, 8, &e->v.id)) {
+			return 1;
+		}
+		e->key.type = ST_ID;
+		return 0;
+	}
+	return 1;
+}
+
+static int
+_dec_key(struct decoder *d, struct table_key *k) {
+	struct table_entry tmp;
+	// a table is not a valid key, the depth stops it
+	if (_dec_value(d, NULL, &tmp, ENCODE_DEPTH)) {
+		return 1;
+	}
+	if (tmp.key.type == ST_STRING) {
+		k->key = tmp.v.p;
+		k->sz_idx = tmp.sz;
+		return 0;
+	}
+	if (tmp.key.type == ST_INTEGER) {
+		// a negative key is a lua index <= 0
+		k->key = NULL;
+		k->sz_idx = (size_t)tmp.v.i;
+		return 0;
+	}
+	return 1;
+}
+
+static void
+_dec_free(struct table_entry *e, size_t n) {
+	size_t i;
+	for (i=0;i<n;i++) {
+		if (e[i].sz == TABLE_MARK) {
+			stable_release(e[i].v.p);
+		}
 	}
 }
 
-void
-stable_value_string(union table_value *v, void (*sfunc)(void *ud, const char *str, size_t sz), void *ud) {
-	struct string_slot *s = _grab_string(v->p);
-	sfunc(ud,s->buf,s->sz);
-	_release_string(s);
+static struct table *
+_dec_table(struct decoder *d, struct table *parent, size_t n, int array, int depth) {
+	// each entry takes at least one byte
+	if (depth > ENCODE_DEPTH || n > (size_t)(d->end - d->p)) {
+		return NULL;
+	}
+	struct table *t = parent ? stable_create_child(parent) : stable_create();
+	struct table_entry *e = malloc(n * sizeof(*e) + 1);
+	size_t i;
+	for (i=0;i<n;i++) {
+		if (array) {
+			e[i].key.key = NULL;
+			e[i].key.sz_idx = i;
+		} else if (_dec_key(d, &e[i].key)) {
+			break;
+		}
+		if (_dec_value(d, t, &e[i], depth)) {
+			break;
+		}
+	}
+	if (i < n) {
+		_dec_free(e, i);
+		free(e);
+		stable_release(t);
+		return NULL;
+	}
+	if (stable_setbatch(t, e, n)) {
+		// a duplicated key with another type, release the tables not set
+		for (i=0;i<n;i++) {
+			if (e[i].key.type != ST_NIL) {
+				e[i].sz = 0;
+			}
+		}
+		_dec_free(e, n);
+	}
+	free(e);
+	return t;
 }
 
-static struct array *
-_expand_array(struct table *t, size_t idx) {
-	struct array * old = t->array;
-	int sz = old->size;
-	while (sz <= idx) {
-		sz *= 2;
+struct table *
+stable_decode_msgpack(struct table *parent, const char *buf, size_t sz, size_t *used) {
+	struct decoder d;
+	struct table_entry e;
+	d.p = (const uint8_t *)buf;
+	d.end = d.p + sz;
+	if (_dec_value(&d, parent, &e, 0)) {
+		return NULL;
 	}
+	if (e.key.type != ST_TABLE) {
+		return NULL;
+	}
+	if (used) {
+		*used = (const char *)d.p - buf;
+	}
+	return e.v.p;
+}
 
-	struct array * a = _create_array(sz);
-	memcpy(a->a, old->a, old->size * sizeof(struct value));
-
-	_update_array(t, a);
+/*
+	stable_freeze replaces the map, array and shards of each table of a
+	subtree with one frozen blob. The generations are freed at once, so no
+	reader or writer may use the subtree meanwhile : freeze a tree before it's
+	published.
+ */
 
-	return a;
+static inline size_t
+_align(size_t sz) {
+	return (sz + 7) & ~(size_t)7;
 }
 
-static void
-_insert_hash(struct map *m, struct string_slot *k, struct value *v) {
-	uint32_t h = hash(k->buf,k->sz);
-	struct node **pn = &m->n[h & (m->size-1)];
-	struct node * n = malloc(sizeof(*n));
-	n->next = *pn;
-	n->k = k;
-	n->v = *v;
+// blob bytes of a long string value
+static inline size_t
+_frozen_string_size(struct value *v) {
+	if (v->type != ST_STRING || _short_string(v)) {
+		return 0;
+	}
+	return _align(sizeof(struct string)) + _align(sizeof(struct string_slot) + v->v.s->slot->sz);
+}
 
-	*pn = n;
+static char *
+_frozen_copy_string(struct context *ctx, struct value *v, char *p) {
+	v->seq = 0;
+	if (v->type != ST_STRING || _short_string(v)) {
+		return p;
+	}
+	struct string_slot *old = v->v.s->slot;
+	struct string *s = (struct string *)p;
+	p += _align(sizeof(struct string));
+	struct string_slot *slot = (struct string_slot *)p;
+	p += _align(sizeof(struct string_slot) + old->sz);
+	slot->next = NULL;
+	slot->ref = 1;	// never released, the blob is freed as a whole
+	slot->sz = old->sz;
+	slot->cap = old->sz;
+	slot->seq = 0;
+	memcpy(slot->buf, old->buf, old->sz + 1);
+	s->slot = slot;
+	s->ctx = ctx;
+	v->v.s = s;
+	return p;
 }
 
-static void 
-_expand_hash(struct table *t) {
-	struct map * old = t->map;
-	struct map * m = _create_hash(old->size * 2);
+static int
+_by_size(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return x < y ? 1 : (x > y ? -1 : 0);
+}
 
-	int i;
-	for (i=0;i<old->size;i++) {
-		struct node * n = old->n[i];
-		while (n) {
-			struct node * next = n->next;
-			_insert_hash(m, n->k, &n->v);
-			n = next;
+/*
+	Hash and displace : the buckets, largest first, each take the first
+	displacement d that puts all their keys in free slots. pos[i] gets the
+	slot of key i. Returns 1 if the keys can't be split (equal hashes).
+ */
+static int
+_perfect_hash(const uint32_t *hash, uint32_t n, uint32_t nbucket, uint32_t *disp, uint32_t *pos) {
+	uint32_t *start = calloc(nbucket + 1, sizeof(uint32_t));
+	uint32_t *cursor = malloc(nbucket * sizeof(uint32_t));
+	uint32_t *member = malloc(n * sizeof(uint32_t));
+	uint64_t *order = malloc(nbucket * sizeof(uint64_t));
+	uint8_t *used = calloc(n, 1);
+	uint32_t i, j, k, b;
+	int r = 0;
+	for (i=0;i<n;i++) {
+		++start[_frozen_bucket(hash[i], nbucket) + 1];
+	}
+	for (b=0;b<nbucket;b++) {
+		order[b] = (uint64_t)start[b+1] << 32 | b;
+		start[b+1] += start[b];
+		cursor[b] = start[b];
+		disp[b] = 0;
+	}
+	for (i=0;i<n;i++) {
+		member[cursor[_frozen_bucket(hash[i], nbucket)]++] = i;
+	}
+	qsort(order, nbucket, sizeof(uint64_t), _by_size);
+	for (b=0;b<nbucket && r == 0;b++) {
+		uint32_t bucket = (uint32_t)order[b];
+		uint32_t from = start[bucket];
+		uint32_t to = start[bucket+1];
+		uint32_t d;
+		if (from == to) {
+			break;
+		}
+		for (d=0;d<FROZEN_MAX_DISP;d++) {
+			for (j=from;j<to;j++) {
+				uint32_t p = _frozen_index(hash[member[j]], d, n);
+				if (used[p]) {
+					break;
+				}
+				used[p] = 1;
+				pos[member[j]] = p;
+			}
+			if (j == to) {
+				break;
+			}
+			for (k=from;k<j;k++) {
+				used[pos[member[k]]] = 0;
+			}
 		}
+		if (d == FROZEN_MAX_DISP) {
+			r = 1;
+		}
+		disp[bucket] = d;
 	}
-
-	_update_map(t,m);
+	free(start);
+	free(cursor);
+	free(member);
+	free(order);
+	free(used);
+	return r;
 }
 
-static struct node *
-_new_node(const char *key, size_t sz, int type) {
-	struct node * n = malloc(sizeof(*n));
-	n->next = NULL;
-	n->k = new_string(key,sz);
-	n->v.type = type;
-	return n;
+// the nodes of m go to slot[*n ...] (keys still point to the nodes), returns the blob bytes they need
+static size_t
+_frozen_nodes(struct map *m, struct frozen_slot *slot, uint32_t *n) {
+	size_t bytes = 0;
+	int i;
+	for (i=0;i<m->size;i++) {
+		struct node *node;
+		for (node = m->n[i]; node; node = node->next) {
+			if (slot) {
+				struct frozen_slot *s = &slot[*n];
+				s->key = node->k ? node->k->buf : NULL;
+				s->sz_idx = node->k ? node->k->sz : node->idx;
+				s->v = node->v;
+			}
+			++*n;
+			if (node->k) {
+				bytes += _align(node->k->sz + 1);
+			}
+			bytes += _frozen_string_size(&node->v);
+		}
+	}
+	return bytes;
 }
 
-struct table * 
-stable_table(struct table *t, const char *key, size_t sz_idx) {
-	struct value tmp;
-	_search_table(t,key,sz_idx,&tmp);
-	if (tmp.type == ST_TABLE) {
-		return tmp.v.t;
-	} 
-	assert(tmp.type == ST_NIL);
-	return NULL;
+// collect the nodes of t and its shards, the first call (slot == NULL) only counts them
+static size_t
+_frozen_collect(struct table *t, struct frozen_slot *slot, uint32_t *n) {
+	size_t bytes = 0;
+	*n = 0;
+	if (t->map) {
+		bytes += _frozen_nodes(t->map, slot, n);
+	}
+	if (t->shard) {
+		int i;
+		for (i=0;i<(1<<t->shard_bits);i++) {
+			struct table *s = t->shard[i];
+			if (s->map) {
+				bytes += _frozen_nodes(s->map, slot, n);
+			}
+		}
+	}
+	return bytes;
 }
 
 static int
-_insert_array_value(struct table *t, size_t idx, struct value *v) {
+_freeze_table(struct table *t) {
+	struct context *ctx = t->ctx;
 	struct array *a = t->array;
-	if (a == NULL) {
-		a = _init_array(t,idx);
-	} else {
-		if (idx >= a->size) {
-			a = _expand_array(t,idx);
+	uint32_t narray = 0, nslot, i;
+	size_t bytes = 0;
+	if (a) {
+		for (i=0;i<a->size;i++) {
+			struct value *v = _array_slot(a, i);
+			if (v->type != ST_NIL) {
+				narray = i + 1;
+				bytes += _frozen_string_size(v);
+			}
 		}
 	}
-	int type = a->a[idx].type;
-	a->a[idx] = *v;
-	return type;
-}
+	bytes += _frozen_collect(t, NULL, &nslot);
+	uint32_t nbucket = nslot ? nslot / 2 + 1 : 0;
+	size_t size = _align(sizeof(struct frozen)) + narray * sizeof(struct value)
+		+ nslot * sizeof(struct frozen_slot) + _align(nbucket * sizeof(uint32_t)) + bytes;
+	struct frozen *f = _alloc(ctx, size);
+	char *p = (char *)f + _align(sizeof(struct frozen));
+	f->size = size;
+	f->narray = narray;
+	f->nslot = nslot;
+	f->nbucket = nbucket;
+	f->array = (struct value *)p;
+	p += narray * sizeof(struct value);
+	f->slot = (struct frozen_slot *)p;
+	p += nslot * sizeof(struct frozen_slot);
+	f->disp = (uint32_t *)p;
+	p += _align(nbucket * sizeof(uint32_t));
 
-static int
-_insert_map_value(struct table *t, const char *key, size_t sz, struct value *v) {
-	struct map *m = t->map;
-	if (m == NULL) {
-		m = _init_map(t);
+	struct frozen_slot *tmp = malloc(nslot * sizeof(struct frozen_slot) + 1);
+	uint32_t *hash = malloc(nslot * sizeof(uint32_t) + 1);
+	uint32_t *pos = malloc(nslot * sizeof(uint32_t) + 1);
+	_frozen_collect(t, tmp, &nslot);
+	uint32_t seed;
+	for (seed=0;seed<FROZEN_SEED_TRY;seed++) {
+		for (i=0;i<nslot;i++) {
+			hash[i] = _frozen_hash(tmp[i].key, tmp[i].sz_idx, seed);
+		}
+		if (nslot == 0 || _perfect_hash(hash, nslot, nbucket, f->disp, pos) == 0) {
+			break;
+		}
 	}
-	uint32_t h = hash(key,sz);
-	struct node **pn = &m->n[h & (m->size-1)];
-	int depth = 0;
-	while (*pn) {
-		struct node *tmp = *pn;
-		if (cmp_string(tmp->k, key, sz)) {
-			int type = tmp->v.type;
-			tmp->v.v = v->v;
-			return type;
+	if (seed == FROZEN_SEED_TRY) {
+		_free(ctx, f, size);
+		free(tmp);
+		free(hash);
+		free(pos);
+		return 1;
+	}
+	f->seed = seed;
+	for (i=0;i<narray;i++) {
+		f->array[i] = *_array_slot(a, i);
+		p = _frozen_copy_string(ctx, &f->array[i], p);
+	}
+	for (i=0;i<nslot;i++) {
+		struct frozen_slot *s = &f->slot[pos[i]];
+		*s = tmp[i];
+		if (s->key) {
+			memcpy(p, tmp[i].key, tmp[i].sz_idx);
+			p[tmp[i].sz_idx] = '\0';
+			s->key = p;
+			p += _align(tmp[i].sz_idx + 1);
 		}
-		pn = &tmp->next;
-		++depth;
+		p = _frozen_copy_string(ctx, &s->v, p);
 	}
+	assert(p == (char *)f + size);
+	free(tmp);
+	free(hash);
+	free(pos);
 
-	struct node * n = _new_node(key,sz,v->type);
-	n->v = *v;
-	*pn = n;
-
-	if (depth > MAX_HASH_DEPTH) {
-		_expand_hash(t);
+	t->frozen = f;
+	// the references to subtables moved to f, _clear_value without pending keeps them
+	if (a) {
+		_delete_array(ctx, a, NULL);
+		t->array = NULL;
 	}
-
-	return ST_NIL;
-}
-
-static inline int
-_insert_table(struct table *t, const char *key, size_t sz_idx, struct value *v) {
-	_table_lock(t);
-	int type;
-	if (key == NULL) {
-		type = _insert_array_value(t, sz_idx , v);
-	} else {
-		type = _insert_map_value(t,key,sz_idx, v);
+	if (t->map) {
+		_delete_map(ctx, t->map, NULL);
+		t->map = NULL;
 	}
-	_table_unlock(t);
-	return type;
-}
-
-int
-stable_settable(struct table *t, const char *key, size_t sz_idx, struct table * sub) {
-	struct value tmp;
-	_search_table(t,key,sz_idx,&tmp);
-	if (tmp.type == ST_TABLE) {
-		stable_release(tmp.v.t);
+	if (t->shard) {
+		int i;
+		for (i=0;i<(1<<t->shard_bits);i++) {
+			struct table *s = t->shard[i];
+			if (s->map) {
+				_delete_map(ctx, s->map, NULL);
+			}
+			s->magic = 0;
+			_free(ctx, s, sizeof(*s));
+			__sync_sub_and_fetch(&ctx->ref, 1);
+		}
+		_free(ctx, t->shard, sizeof(struct table *) << t->shard_bits);
+		t->shard = NULL;
+		t->shard_bits = 0;
 	}
-
-	tmp.type = ST_TABLE;
-	tmp.v.t = sub;
-	int type = _insert_table(t,key,sz_idx,&tmp);
-	if (type != ST_NIL && type!= ST_TABLE) {
-		return 1;
+	if (t->nums) {
+		_free(ctx, t->nums, ARRAY_BITS * sizeof(uint32_t));
+		t->nums = NULL;
 	}
+	t->array_count = 0;
+	t->map_index = 0;
 	return 0;
 }
 
 int
-stable_setnumber(struct table *t, const char *key, size_t sz_idx, double n) {
-	struct value tmp;
-	tmp.type = ST_NUMBER;
-	tmp.v.n = n;
-	int type = _insert_table(t,key,sz_idx,&tmp);
-	return type != ST_NUMBER && type != ST_NIL;
+stable_freeze(struct table *t) {
+	struct gc_set stack = { NULL, 0, 0 };
+	int fail = 0;
+	_gc_push(&stack, t);
+	while (stack.n > 0) {
+		t = stack.t[--stack.n];
+		if (t->frozen) {
+			continue;
+		}
+		if (_freeze_table(t)) {
+			++fail;
+			continue;
+		}
+		uint32_t i;
+		for (i=0;i<t->frozen->narray + t->frozen->nslot;i++) {
+			struct value *v = _frozen_value(t->frozen, i);
+			if (v->type == ST_TABLE && v->v.t && !v->v.t->frozen) {
+				_gc_push(&stack, v->v.t);
+			}
+		}
+	}
+	free(stack.t);
+	return fail;
 }
 
 int
-stable_setboolean(struct table *t, const char *key, size_t sz_idx, int b) {
-	struct value tmp;
-	tmp.type = ST_BOOLEAN;
-	tmp.v.b = b;
-	int type = _insert_table(t,key,sz_idx,&tmp);
-	return type != ST_BOOLEAN && type != ST_NIL;
+stable_frozen(struct table *t) {
+	return t->frozen != NULL;
 }
 
-int
-stable_setid(struct table *t, const char *key, size_t sz_idx, uint64_t id) {
-	struct value tmp;
-	tmp.type = ST_ID;
-	tmp.v.id = id;
-	int type = _insert_table(t,key,sz_idx,&tmp);
-	return type != ST_ID && type != ST_NIL;
-}
+/*
+	A channel is a bounded MPMC ring of table handles (Vyukov's queue) : a
+	cell is free for the sender at position pos when its seq is pos, and
+	full for the receiver when its seq is pos+1. A blocked sender sleeps on
+	send_seq, bumped by each receive, and a blocked receiver on recv_seq,
+	bumped by each send. The futex word is read before the last try, so a
+	bump between the try and the wait makes the wait return at once.
+ */
 
-int
-stable_setstring(struct table *t, const char *key, size_t sz_idx, const char * str, size_t sz) {
-	struct value tmp;
-	_search_table(t,key,sz_idx,&tmp);
-	if (tmp.type == ST_STRING) {
-		_update_string(tmp.v.s, str, sz);
-		return 0;
+struct channel_cell {
+	uint64_t seq;
+	struct table *t;
+};
+
+struct stable_channel {
+	int ref;
+	uint32_t mask;
+	int send_seq;
+	int send_wait;
+	int recv_seq;
+	int recv_wait;
+	char pad0[CHANNEL_PAD];
+	uint64_t head;	// next send position
+	char pad1[CHANNEL_PAD];
+	uint64_t tail;	// next receive position
+	char pad2[CHANNEL_PAD];
+	struct channel_cell cell[1];
+};
+
+
+struct stable_channel *
+stable_channel_create(size_t cap) {
+	// at least DEFAULT_SIZE (4), the sequence numbers of the cells need 2 or more
+	size_t n = DEFAULT_SIZE;
+	while (n < cap) {
+		n *= 2;
 	}
-	if (tmp.type != ST_NIL) {
-		return 1;
+	struct stable_channel *c = malloc(sizeof(*c) + (n-1) * sizeof(struct channel_cell));
+	memset(c, 0, sizeof(*c));
+	c->ref = 1;
+	c->mask = n - 1;
+	size_t i;
+	for (i=0;i<n;i++) {
+		c->cell[i].seq = i;
+		c->cell[i].t = NULL;
 	}
-	struct string * s = malloc(sizeof(*s));
-	memset(s,0,sizeof(*s));
-	s->slot = new_string(str,sz);
-	tmp.type = ST_STRING;
-	tmp.v.s = s;
-	_insert_table(t,key,sz_idx,&tmp);
+	return c;
+}
 
-	return 0;
+void
+stable_channel_grab(struct stable_channel *c) {
+	__sync_add_and_fetch(&c->ref, 1);
 }
 
-size_t 
-stable_cap(struct table *t) {
-	size_t s = 0;
-	if (t->array) {
-		struct array * a = _grab_array(t);
-		s += a->size;
-		_release_array(a);
-	}
-	if (t->map) {
-		struct map * m = _grab_map(t);
-		if (m) {
-			s += m->size * MAX_HASH_DEPTH;
+static int
+_channel_push(struct stable_channel *c, struct table *t) {
+	uint64_t pos = __atomic_load_n(&c->head, __ATOMIC_RELAXED);
+	for (;;) {
+		struct channel_cell *cell = &c->cell[pos & c->mask];
+		uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		int64_t diff = (int64_t)(seq - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&c->head, &pos, pos + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+				cell->t = t;
+				__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+				return 1;
+			}
+		} else if (diff < 0) {
+			return 0;	// full
+		} else {
+			pos = __atomic_load_n(&c->head, __ATOMIC_RELAXED);
 		}
-		_release_map(m);
 	}
-	return s;
 }
 
-size_t 
-stable_keys(struct table *t, struct table_key *vv, size_t cap) {
-	size_t count = 0;
-	if (t->array) {
-		struct array * a = _grab_array(t);
-		int i;
-		for (i=0;i<a->size;i++) {
-			if (count>=cap) {
-				_release_array(a);
-				return count;
-			}
-			struct value *v = &(a->a[i]);
-			if (v->type == ST_NIL) {
-				continue;
+static struct table *
+_channel_pop(struct stable_channel *c) {
+	uint64_t pos = __atomic_load_n(&c->tail, __ATOMIC_RELAXED);
+	for (;;) {
+		struct channel_cell *cell = &c->cell[pos & c->mask];
+		uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		int64_t diff = (int64_t)(seq - (pos + 1));
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&c->tail, &pos, pos + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+				struct table *t = cell->t;
+				__atomic_store_n(&cell->seq, pos + c->mask + 1, __ATOMIC_RELEASE);
+				return t;
 			}
-			vv[count].type = v->type;
-			vv[count].key = NULL;
-			vv[count].sz_idx = i;
-			++count;
+		} else if (diff < 0) {
+			return NULL;	// empty
+		} else {
+			pos = __atomic_load_n(&c->tail, __ATOMIC_RELAXED);
 		}
-		_release_array(a);
 	}
-	if (t->map) {
-		struct map * m = _grab_map(t);
-		int i;
-		for (i=0;i<m->size;i++) {
-			struct node * n =  m->n[i];
-			while (n) {
-				if (count>=cap) {
-					_release_map(m);
-					return count;
-				}
-				vv[count].type = n->v.type;
-				vv[count].key = n->k->buf;
-				vv[count].sz_idx = n->k->sz;
-				++count;
-				n=n->next;
-			}
+}
+
+int
+stable_channel_send(struct stable_channel *c, struct table *t, int block) {
+	assert(t != NULL);
+	for (;;) {
+		int seq = __atomic_load_n(&c->send_seq, __ATOMIC_SEQ_CST);
+		if (_channel_push(c, t)) {
+			_futex_notify(&c->recv_seq, &c->recv_wait);
+			return 0;
+		}
+		if (!block) {
+			return 1;
 		}
-		_release_map(m);
+		__sync_add_and_fetch(&c->send_wait, 1);
+		_futex_wait(&c->send_seq, seq);
+		__sync_sub_and_fetch(&c->send_wait, 1);
 	}
-	return count;
+}
+
+struct table *
+stable_channel_recv(struct stable_channel *c, int block) {
+	for (;;) {
+		int seq = __atomic_load_n(&c->recv_seq, __ATOMIC_SEQ_CST);
+		struct table *t = _channel_pop(c);
+		if (t) {
+			_futex_notify(&c->send_seq, &c->send_wait);
+			return t;
+		}
+		if (!block) {
+			return NULL;
+		}
+		__sync_add_and_fetch(&c->recv_wait, 1);
+		_futex_wait(&c->recv_seq, seq);
+		__sync_sub_and_fetch(&c->recv_wait, 1);
+	}
+}
+
+void
+stable_channel_release(struct stable_channel *c) {
+	if (__sync_sub_and_fetch(&c->ref, 1) != 0) {
+		return;
+	}
+	struct table *t;
+	while ((t = _channel_pop(c))) {
+		stable_release(t);
+	}
+	free(c);
 }
@@ -10,6 +10,7 @@
 #define ST_ID 3
 #define ST_STRING 4
 #define ST_TABLE 5
+#define ST_INTEGER 6
 
 struct table_key {
 	int type;
@@ -21,37 +22,219 @@ union table_value {
 	double n;
 	int b;
 	uint64_t id;
+	int64_t i;
 	void *p;
+	char str[16];	// short string stored inline, use stable_value_string
 };
 
 struct table;
 
 typedef void (*table_setstring_func)(void *ud, const char *str, size_t sz);
 
+// free gets the size passed to alloc, so sized deallocation (sdallocx) can be used.
+
+struct stable_allocator {
+	void * (*alloc)(void *ud, size_t sz);
+	void (*free)(void *ud, void *p, size_t sz);
+	void *ud;
+};
+
+struct stable_memory {
+	size_t total;	// bytes allocated by the tree, including retired
+	size_t retired;	// bytes of replaced generations still pinned by readers
+};
+
 struct table * stable_create();
+// alloc NULL means malloc/free. Each call creates a new tree with its own accounting.
+struct table * stable_create_ex(const struct stable_allocator *alloc);
+// Create a table sharing the allocator and the accounting of parent.
+struct table * stable_create_child(struct table *parent);
+void stable_memory(struct table *, struct stable_memory *m);
+// A sharded table splits its string keys into n (rounded up to a power of 2, at most 256) sub tables,
+// each with its own write lock, so writers of different keys can run in parallel.
+struct table * stable_create_sharded(struct table *parent, int n);
+// A detached table takes no lock on write. Only one thread may write it (different detached
+// tables can be built by different threads), and no one may read it until it's attached
+// by stable_swap_table. parent (may be NULL) gives the tree to share accounting with.
+struct table * stable_create_detached(struct table *parent);
 void stable_grab(struct table *);
 int stable_getref(struct table *);
 void stable_release(struct table *);
 
+// An optional reclaimer thread: while it runs, stable_release of the last reference only queues
+// the tree, and the reclaimer frees it. flush waits until every queued tree is freed.
+// start returns 1 if it's already running (or the thread can't be created).
+int stable_reclaim_start();
+void stable_reclaim_flush();
+void stable_reclaim_stop();
+
+// An optional read cache for the calling thread. Numbers, booleans, ids, integers and nils
+// read by stable_type and the scalar getters are cached with the version of their table, and a
+// hit costs no shared memory write. Disable it before the thread exits to free it.
+// stable_cache_stats returns 0 if the cache of the calling thread is disabled.
+void stable_cache_enable(int enable);
+int stable_cache_stats(uint64_t *hit, uint64_t *miss);
+
+// Cycle collection. A table referenced by a cycle of tables never reaches ref 0. Once
+// stable_collect_start() is called, a release leaving a table alive records it as a candidate,
+// and stable_collect() frees the garbage cycles found from the candidates, returning the number
+// of tables freed. Readers may run during a collection; settable, swap, grab and release may not.
+// stable_collect_stop() stops recording and collects the candidates left.
+void stable_collect_start();
+size_t stable_collect();
+size_t stable_collect_stop();
+
+// A bounded lock free channel of table handles, for passing tables between threads (or lua states).
+// send moves the caller's reference of t into the channel and recv moves it to the caller, so a handle
+// in a channel is never freed. With block, send waits while the channel is full and recv while it's
+// empty; otherwise send returns 1 (the caller keeps its reference) and recv returns NULL.
+// cap is rounded up to a power of 2, at least 4 (a channel of 1 or 2 holds 4 handles). The last release drops the references left in the channel.
+struct stable_channel;
+struct stable_channel * stable_channel_create(size_t cap);
+void stable_channel_grab(struct stable_channel *);
+void stable_channel_release(struct stable_channel *);
+int stable_channel_send(struct stable_channel *, struct table *t, int block);
+struct table * stable_channel_recv(struct stable_channel *, int block);
+
 #define TKEY(x) x,sizeof(x)
 #define TINDEX(x) NULL,x
 
 double stable_number(struct table *, const char *key, size_t sz_idx);
 int stable_boolean(struct table *, const char *key, size_t sz_idx);
 uint64_t stable_id(struct table *, const char *key, size_t sz_idx);
+int64_t stable_integer(struct table *, const char *key, size_t sz_idx);
 void stable_string(struct table *, const char *key, size_t sz_idx, table_setstring_func sfunc, void *ud);
 struct table * stable_table(struct table *, const char *key, size_t sz_idx);
 
 int stable_type(struct table *, const char *key, size_t sz_idx, union table_value *v);
 void stable_value_string(union table_value *v, table_setstring_func sfunc, void *ud);
+// Follow the n keys of path (key and sz_idx are used) through nested tables in one call.
+// stable_path returns the table at the end of path (NULL if a step is not a table),
+// stable_getpath reads the value at path (ST_NIL if a step is missing).
+struct table * stable_path(struct table *, const struct table_key *path, int n);
+int stable_getpath(struct table *, const struct table_key *path, int n, union table_value *v);
+
+// A view pins the bytes of a string value until stable_string_release, even if the value
+// is overwritten meanwhile. Release every view before the table is released.
+
+struct table_string {
+	const char *str;	// may point to buf, so don't copy a view
+	size_t sz;
+	void *slot;	// release token
+	void *ctx;
+	char buf[16];
+};
+
+// returns 0 (and an empty view) when the value is not a string
+int stable_string_view(struct table *, const char *key, size_t sz_idx, struct table_string *view);
+void stable_value_string_view(union table_value *v, struct table_string *view);
+void stable_string_release(struct table_string *view);
 
 int stable_settable(struct table *, const char *key, size_t sz_idx, struct table *);
 int stable_setnumber(struct table *, const char *key, size_t sz_idx, double n);
 int stable_setboolean(struct table *, const char *key, size_t sz_idx, int b);
 int stable_setid(struct table *, const char *key, size_t sz_idx, uint64_t id);
+int stable_setinteger(struct table *, const char *key, size_t sz_idx, int64_t i);
 int stable_setstring(struct table *, const char *key, size_t sz_idx, const char * str, size_t sz);
+// Publish t with its detached subtables, and replace the table at key of parent by t in one store,
+// so readers see either the old tree or the new one. *old gets the replaced table (or NULL),
+// release it when no reader may still use it. returns 1 if the slot holds another type.
+int stable_swap_table(struct table *parent, const char *key, size_t sz_idx, struct table *t, struct table **old);
+
+// Atomic with other writers of the table. A nil slot counts as 0 for add, and takes v for min/max.
+// result (may be NULL) gets the new value, returns 1 if the slot holds another type.
+int stable_addnumber(struct table *, const char *key, size_t sz_idx, double delta, double *result);
+int stable_addinteger(struct table *, const char *key, size_t sz_idx, int64_t delta, int64_t *result);
+int stable_minnumber(struct table *, const char *key, size_t sz_idx, double v, double *result);
+int stable_maxnumber(struct table *, const char *key, size_t sz_idx, double v, double *result);
+// Set v if the slot holds expect of type (ST_NUMBER, ST_BOOLEAN, ST_ID or ST_INTEGER), returns 1 if it was set.
+int stable_cas(struct table *, const char *key, size_t sz_idx, int type, const union table_value *expect, const union table_value *v);
+
+// Number kernels over the integer keys [from, to). ST_INTEGER values count as numbers,
+// values of other types (and NAN) are skipped.
+// The array part is read from one pinned generation.
+#define ST_LT 0
+#define ST_LE 1
+#define ST_EQ 2
+#define ST_NE 3
+#define ST_GE 4
+#define ST_GT 5
+
+// count (may be NULL) gets the number of numbers
+double stable_sum(struct table *, size_t from, size_t to, size_t *count);
+// returns 0 if there is no number
+int stable_minmax(struct table *, size_t from, size_t to, double *min, double *max);
+size_t stable_count_if(struct table *, size_t from, size_t to, int op, double v);
+// returns 1 and the index of the first number matching op v
+int stable_find_first(struct table *, size_t from, size_t to, int op, double v, size_t *idx);
+
+struct table_entry {
+	struct table_key key;	// key.type is the type of v
+	union table_value v;	// for ST_STRING, v.p points to sz bytes
+	size_t sz;
+};
+
+// Set n entries under one table lock, presizing the array and map parts first.
+// An entry that can't be set because its slot holds another type gets key.type ST_NIL,
+// returns the number of such entries.
+int stable_setbatch(struct table *, struct table_entry *e, size_t n);
+
+// Write combining. stable_post copies e (the key and the string) to a lock free queue of t and returns
+// a ticket; the poster finding no applier sets the whole queue with one stable_setbatch, the others
+// return at once. In a batch, the last entry of a key wins, and entries failing to be set are dropped
+// (an ST_TABLE entry passes its reference). stable_sync(t, ticket) returns once the entries posted
+// before ticket was returned are set, ticket 0 waits for every entry posted before the call.
+uint64_t stable_post(struct table *, const struct table_entry *e);
+void stable_sync(struct table *, uint64_t ticket);
 
 size_t stable_cap(struct table *);
 size_t stable_keys(struct table *, struct table_key *v, size_t cap);
 
+// Call func for each non nil value of one snapshot of the array and map generations,
+// key->type is the type of v. func must return normally, or the snapshot is never released.
+typedef void (*table_foreach_func)(void *ud, const struct table_key *key, union table_value *v);
+size_t stable_foreach(struct table *, table_foreach_func func, void *ud);
+// Non nil slots in the array part and keys in the map part, a hint to presize a copy.
+void stable_size(struct table *, size_t *array, size_t *hash);
+
+// MessagePack. stable_encode_msgpack streams one snapshot of t to writer in chunks, without allocation:
+// a table is a map, integer keys are 0 based integers, ids are ext type 1. It returns 1 (the output is
+// cut) if the tree is deeper than 64. stable_decode_msgpack builds a tree from the map (or the array, keys
+// are 0 based) at buf, sharing the accounting of parent (may be NULL). It returns NULL if buf is invalid,
+// and used (may be NULL) gets the bytes read.
+int stable_encode_msgpack(struct table *t, table_setstring_func writer, void *ud);
+struct table * stable_decode_msgpack(struct table *parent, const char *buf, size_t sz, size_t *used);
+
+// Freeze. stable_freeze packs t and its subtree into one immutable block per table: a dense array and
+// a perfect hash of the other keys, strings inline. Reads are plain loads, set/cas/add on a frozen table
+// fail. No thread may use the tree during the freeze, so freeze it before it's published. Returns the
+// number of tables that can't be frozen (left as they were).
+int stable_freeze(struct table *t);
+int stable_frozen(struct table *t);
+
+// Counters are only collected when stable.c is compiled with -DSTABLE_STATS.
+// stable_stats returns 0 (and zeroes st) otherwise.
+
+struct stable_stats {
+	uint64_t map_retry;	// reader retried because map was replaced
+	uint64_t array_retry;	// reader retried because array was replaced
+	uint64_t lock_spin;	// spin iterations on table write lock
+	uint64_t grab_spin;	// spin iterations on map/array grab
+	uint64_t hash_expand;
+	uint64_t array_expand;
+	uint64_t lookup;	// hash lookups
+	uint64_t probe;	// nodes visited by hash lookups, probe/lookup is the average
+	uint64_t probe_max;
+	int64_t map_live;	// map generations not freed yet
+	int64_t array_live;	// array generations not freed yet
+	uint64_t gc_run;	// stable_collect calls
+	uint64_t gc_scan;	// tables scanned by stable_collect
+	uint64_t gc_collect;	// tables freed by stable_collect
+	uint64_t post_batch;	// batches of posted entries applied
+	uint64_t post_coalesce;	// posted entries overwritten by a later one of the same batch
+	uint64_t string_inplace;	// long strings rewritten in their slot
+};
+
+int stable_stats(struct stable_stats *st);
+
 #endif
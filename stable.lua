@@ -1,5 +1,4 @@
 local c = require "stable.raw"
-local int64 = require "int64"
 local assert = assert
 local rawset = rawset
 local rawget = rawget
@@ -9,6 +8,11 @@ local stable_settable = assert(c.settable)
 
 local stable = {}
 
+-- int64 is only needed by "userdata" fields, use "integer" instead on lua 5.3+
+local function int64_zero()
+	return require("int64").new(0)
+end
+
 --[[
 	type info
 
@@ -19,6 +23,7 @@ local stable = {}
 			key3 = "*number",	-- array number
 			key4 = "*boolean",	-- array boolean
 			key5 = "number",	-- number , default is 0
+			key5i = "integer",	-- 64bit integer, default is 0
 			key6 = "boolean",	-- boolean, default is false
 			key7 = "string",	-- string, default is ""
 			key8 = "", -- string, default is ""
@@ -29,6 +34,10 @@ local stable = {}
 			}
 			key12 = { "ENUM1", "ENUM2" } -- anonymous enum
 		},
+		type3 = {
+			key1 = 0,
+			index = "key1",	-- arrays of type3 keep a hash index of key1, see stable.find
+		},
 		type2 = {		-- named enum
 			"ENUM1",
 			"ENUM2",
@@ -39,6 +48,7 @@ local stable = {}
 local _typeinfo -- table
 local _bind	-- function
 local _create_node -- function
+local _proto -- function
 
 local function _next(self, key)
 	local next_key
@@ -55,25 +65,37 @@ end
 
 local _array_meta
 
-local function _bind_array(self , typename)
-	if typename == "*number" then
-		self.__type = "number"
-	elseif typename == "*boolean" then
-		self.__type = "boolean"
-	elseif typename == "*string" then
-		self.__type = "string"
-	elseif typename == "*userdata" then
-		self.__type = "userdata"
+local _array_basetype = {
+	["*number"] = "number",
+	["*boolean"] = "boolean",
+	["*string"] = "string",
+	["*integer"] = "integer",
+	["*userdata"] = "userdata",
+}
+
+-- returns element type (id_name table for enum) and enum name_id table
+local function _array_type(typename)
+	local basetype = _array_basetype[typename]
+	if basetype then
+		return basetype
+	end
+	typename = string.sub(typename,2)
+	local typeinfo = assert(_typeinfo[typename],typename)
+	if typeinfo[1] == "enum" then
+		return typeinfo.id_name, typeinfo.name_id
 	else
-		typename = string.sub(typename,2)
-		local typeinfo = assert(_typeinfo[typename],typename)
-		if typeinfo[1] == "enum" then
-			self.__type = typeinfo.id_name
-			self.__enum = typeinfo.name_id
-		else
-			self.__type = typename
-		end
+		return typename
 	end
+end
+
+local _proto_ref	-- prototype handle -> grab object
+
+local function _bind_array(self , typename)
+	self.__type, self.__enum = _array_type(typename)
+	local proto = _proto(typename)
+	self.__proto = proto
+	-- keeps the prototype alive after stable.init is called again
+	self.__proto_ref = _proto_ref[proto]
 	return setmetatable(self, _array_meta)
 end
 
@@ -81,7 +103,7 @@ local function default_node(parent_handle, typename, index)
 	local old = stable_get(parent_handle, index)
 	local sub
 	if old == nil then
-		sub = _create_node(typename)
+		sub = _create_node(typename, parent_handle)
 		stable_settable(parent_handle, index, sub.__handle)
 	elseif string.byte(typename) == 42 then	-- '*'
 		-- It's a array
@@ -105,6 +127,55 @@ local function init_map(sobj, map)
 	end
 end
 
+-- The index of an array of structs is a stable table at key 'i' of the array,
+-- from the raw value of the indexed field to the position (0 when removed).
+-- It keeps one position per value, and misses the writes that don't go through
+-- a linked object (sraw.set, C writers), so stable.find checks it against the
+-- element and scans the array when it misses.
+
+local function _index_key(v)
+	local tv = type(v)
+	if tv == "number" then
+		if v == math.floor(v) and v > -2^53 and v < 2^53 then
+			return string.format("#%d", v)
+		end
+		return string.format("#%.17g", v)
+	elseif tv == "string" then
+		return "$" .. v
+	else
+		return v and "?1" or "?0"
+	end
+end
+
+local function _index_update(arr, pos, old, new)
+	local h = stable_get(arr.__handle, 'i')
+	if h == nil then
+		return
+	end
+	stable_set(h, _index_key(new), pos)
+	if old ~= nil and old ~= new then
+		local k = _index_key(old)
+		if stable_get(h, k) == pos then
+			stable_set(h, k, 0)
+		end
+	end
+end
+
+local function _index_field(arr)
+	local typeinfo = type(arr.__type) == "string" and _typeinfo[arr.__type]
+	return typeinfo and typeinfo.index
+end
+
+-- obj is the struct at pos of arr
+local function _link(arr, pos, obj)
+	local field = _index_field(arr)
+	if field then
+		rawset(obj, "__owner", arr)
+		rawset(obj, "__pos", pos)
+	end
+	return obj
+end
+
 local _struct_meta = {
 	__index = function(t,k)
 		local it = t.__get
@@ -141,7 +212,12 @@ local _struct_meta = {
 		local it = t.__set
 		local index = it[k]
 		local enum = it[index]
-		if enum then
+		local owner = rawget(t, "__owner")
+		if owner and _index_field(owner) == k then
+			local old = stable_get(t.__handle, index)
+			stable_set(t.__handle, index , enum and assert(enum[v],v) or v)
+			_index_update(owner, rawget(t, "__pos"), old, stable_get(t.__handle, index))
+		elseif enum then
 			stable_set(t.__handle, index , assert(enum[v],v))
 		elseif type(v) == "table" then
 			local sub = default_node(t.__handle, t.__default[k], index)
@@ -171,7 +247,9 @@ _array_meta = {
 		if index > n then
 			-- todo: remove resize
 			stable.resize(t, index)
-			return rawget(t,index)
+			if not _typeinfo[t.__type] then
+				return
+			end
 		end
 		local obj = stable_get(t.__handle, index)
 		if obj then
@@ -179,7 +257,7 @@ _array_meta = {
 			local typeinfo = _typeinfo[typename]
 
 			if typeinfo then
-				obj = _bind(obj, typeinfo)
+				obj = _link(t, index, _bind(obj, typeinfo))
 				rawset(t,index,obj)
 				return obj
 			elseif type(typename) == "table" then
@@ -200,10 +278,10 @@ _array_meta = {
 		else
 			local typename = type(v)
 			if typename == "table" then
-				local sub = rawget(t, index)
+				local sub = t[index]
 				init_map(sub,v)
 			else
-				assert(typename == t.__type)
+				assert(typename == t.__type or (typename == "number" and t.__type == "integer"))
 				stable_set(t.__handle, index, v)
 			end
 		end
@@ -246,6 +324,18 @@ end
 local _init_typeinfo	-- function
 
 local function _init_struct(info , src)
+	local index = src.index
+	if type(index) == "string" and index ~= "index" and src[index] ~= nil then
+		-- index = "field" declares an index, not a field
+		local fields = {}
+		for k,v in pairs(src) do
+			if k ~= "index" then
+				fields[k] = v
+			end
+		end
+		src = fields
+		info.index = index
+	end
 	info.iter = {}
 	info.get = {}
 	info.set = {}
@@ -276,13 +366,15 @@ local function _init_struct(info , src)
 			anonymous = anonymous + 1
 		elseif t == "string" then
 			if v == "number" then
+				info.default[k] = 0.0
+			elseif v == "integer" then
 				info.default[k] = 0
 			elseif v == "boolean" then
 				info.default[k] = false
 			elseif v == "string" or v == "" then
 				info.default[k] = ""
 			elseif v == "userdata" then
-				info.default[k] = int64.new(0)
+				info.default[k] = int64_zero()
 			else
 				-- default is typename
 				local fc = string.byte(v)
@@ -299,6 +391,9 @@ local function _init_struct(info , src)
 					end
 				end
 			end
+		elseif t == "number" then
+			-- keep it a float, or it would be stored as an integer on lua 5.3+
+			info.default[k] = v + 0.0
 		else
 			info.default[k] = v
 		end
@@ -325,7 +420,13 @@ function _init_typeinfo(info, src)
 	end
 end
 
+local _protos	-- typename -> prototype handle
+
+-- The prototypes are owned by grab objects, so the ones of a previous stable.init
+-- are released when no array bound to them is left.
 function stable.init(typeinfo)
+	_protos = {}
+	_proto_ref = {}
 	_typeinfo = {}
 	for k,v in pairs(typeinfo) do
 		if v[1] then
@@ -340,28 +441,13 @@ function stable.init(typeinfo)
 			_init_struct(_typeinfo[k],v)
 		end
 	end
-
-	return _typeinfo
-end
-
-local function _init(self, typename)
-	local tinfo = _typeinfo[typename]
-	for key,default in pairs(tinfo.default) do
-		local index = tinfo.get[key]
-		if type(default) == "string" then
-			if string.byte(default) == 46 then -- '.'
-				stable_set(self.__handle, index, string.sub(default,2))
-			elseif default == "" then
-				stable_set(self.__handle, index, default)
-			else
-				local sub = _create_node(default)
-				stable_settable(self.__handle, index, sub.__handle)
-				rawset(self, key , sub)
-			end
-		else
-			stable_set(self.__handle, index, default)
+	for k,v in pairs(_typeinfo) do
+		if v[1] == "struct" then
+			_proto(k)
 		end
 	end
+
+	return _typeinfo
 end
 
 function stable.bind( handle , typename)
@@ -371,22 +457,19 @@ function stable.bind( handle , typename)
 	return self
 end
 
--- create_node is local
-function _create_node(typename)
+-- create_node is local, sub nodes share the memory accounting of parent
+function _create_node(typename, parent)
 	local self = {}
-	self.__handle = c.create()
+	self.__handle = c.clone(_proto(typename), parent)
 
 	if string.byte(typename) == 42 then
 		-- '*' == 42 , It's a array
-		stable_set(self.__handle, 's' , 0)
 		return _bind_array(self, typename)
 	end
 	self.__iter = _typeinfo[typename].iter
 	self.__get = _typeinfo[typename].get
 	self.__set = _typeinfo[typename].set
 	self.__default = _typeinfo[typename].default
-
-	_init(self, typename)
 	return setmetatable(self, _struct_meta)
 end
 
@@ -399,68 +482,293 @@ function stable.create(typename)
 end
 
 local _default_value = {
-	number = 0,
+	number = 0.0,
+	integer = 0,
 	boolean = false,
 	string = "",
-	userdata = int64.new(0),
 }
 
-local function _reset_default(self,typename)
-	if string.byte(typename) == 42 then
-		stable.resize(self,0)
-		return
+-- The prototype of a struct or an array type is a stable table, see _clone in lua-stable.c.
+-- local function
+function _proto(typename)
+	local p = _protos[typename]
+	if p then
+		return p
+	end
+	p = c.create()
+	_protos[typename] = p
+	_proto_ref[p] = c.grab(p)
+	c.decref(p)
+	if string.byte(typename) == 42 then	-- '*'
+		stable_set(p, 's', 0)
+		local elemtype, enum = _array_type(typename)
+		if enum then
+			stable_set(p, 'd', 1)
+		elseif _typeinfo[elemtype] then
+			local elem = _proto(elemtype)
+			c.incref(elem)
+			stable_settable(p, 'p', elem)
+			if _typeinfo[elemtype].index then
+				stable_settable(p, 'i', c.create(p))
+			end
+		elseif elemtype == "userdata" then
+			stable_set(p, 'd', int64_zero())
+		else
+			stable_set(p, 'd', _default_value[elemtype])
+		end
+		return p
 	end
 	local tinfo = _typeinfo[typename]
 	for key,default in pairs(tinfo.default) do
 		local index = tinfo.get[key]
 		if type(default) == "string" then
-			if string.byte(default) == 46 then
-				stable_set(self.__handle, index, string.sub(default,2))
+			if string.byte(default) == 46 then -- '.'
+				stable_set(p, index, string.sub(default,2))
 			elseif default == "" then
-				stable_set(self.__handle, index, default)
+				stable_set(p, index, default)
 			else
-				_reset_default(self[key] , default)
+				local sub = _proto(default)
+				c.incref(sub)
+				stable_settable(p, index, sub)
 			end
 		else
-			stable_set(self.__handle, index, default)
+			stable_set(p, index, default)
 		end
 	end
+	return p
 end
 
-function stable.resize(t,size)
-	local n = assert(stable_get(t.__handle,'s'))
-	local typename = t.__type
-	local default
-	if type(typename) == "table" then
+local _export_struct	-- function
+
+-- raw is the result of c.totable, decode enums and nested objects in place
+local function _export_array(raw, elemtype)
+	local n = raw.s or 0
+	raw.s = nil
+	raw.i = nil	-- the index
+	if type(elemtype) == "table" then
 		-- enum
-		default = 1
+		for i = 1, n do
+			raw[i] = elemtype[raw[i]]
+		end
 	else
-		default = _default_value[typename]
-	end
-	if size > n then
-		if default then
-			for i = n+1,size do
-				stable_set(t.__handle, i , default)
+		local typeinfo = _typeinfo[elemtype]
+		if typeinfo then
+			for i = 1, n do
+				raw[i] = _export_struct(raw[i], typeinfo.iter, typeinfo.get, typeinfo.default)
 			end
-		else
-			for i = n+1,size do
-				local obj = default_node(t.__handle, typename, i)
-				rawset(t,i,obj)
+		end
+	end
+	return raw
+end
+
+function _export_struct(raw, iter, get, default)
+	local ret = {}
+	for i, k in ipairs(iter) do
+		local v = raw[i]
+		local enum = get[i]
+		if enum then
+			v = enum[v]
+		elseif type(v) == "table" then
+			local typename = default[k]
+			if string.byte(typename) == 42 then	-- '*'
+				v = _export_array(v, (_array_type(typename)))
+			else
+				local typeinfo = _typeinfo[typename]
+				v = _export_struct(v, typeinfo.iter, typeinfo.get, typeinfo.default)
 			end
 		end
+		ret[k] = v
+	end
+	return ret
+end
+
+-- Copy obj into a plain lua table in one traversal, with enums decoded
+function stable.totable(obj)
+	local raw = c.totable(obj.__handle)
+	if rawget(obj, "__type") then
+		return _export_array(raw, obj.__type)
 	else
-		if default then
-			for i = size+1, n do
-				stable_set(t.__handle, i , default)
+		return _export_struct(raw, obj.__iter, obj.__get, obj.__default)
+	end
+end
+
+local unpack = table.unpack or unpack
+
+-- Translate a path of field names and array indices into raw keys with the type info,
+-- returns the keys, the typename of the last step and its enum tables (id_name, name_id).
+local function _path(obj, ...)
+	local n = select("#", ...)
+	assert(n > 0, "Need a path")
+	local keys = {}
+	local get, set, default, elemtype, elemenum
+	-- the indexed field of the current struct, if it's an element of an array
+	local index_field
+	if rawget(obj, "__type") then
+		elemtype, elemenum = obj.__type, rawget(obj, "__enum")
+	else
+		get, set, default = obj.__get, obj.__set, obj.__default
+		local owner = rawget(obj, "__owner")
+		index_field = owner and _index_field(owner)
+	end
+	local typename, id_name, name_id, indexed, element
+	for i = 1, n do
+		local k = select(i, ...)
+		element = elemtype ~= nil
+		if elemtype then
+			keys[i] = k
+			typename = elemtype
+			if elemenum then
+				id_name, name_id = elemtype, elemenum
+			else
+				id_name, name_id = nil, nil
 			end
 		else
-			for i = size+1, n do
-				_reset_default(t[i], t.__type)
-				rawset(t,i,nil)
+			local index = assert(get[k], k)
+			keys[i] = index
+			typename = default[k]
+			id_name, name_id = get[index], set[index]
+			indexed = index_field == k
+		end
+		if i < n then
+			assert(type(typename) == "string" and id_name == nil, k)
+			local from_array = elemtype ~= nil
+			get, set, default, elemtype, elemenum = nil
+			if string.byte(typename) == 42 then	-- '*'
+				elemtype, elemenum = _array_type(typename)
+			else
+				local typeinfo = assert(_typeinfo[typename], typename)
+				get, set, default = typeinfo.get, typeinfo.set, typeinfo.default
+				index_field = from_array and typeinfo.index
+			end
+		end
+	end
+	return keys, typename, id_name, name_id, indexed, element
+end
+
+-- stable.getpath(obj, "bars", 2, "third", 1) is obj.bars[2].third[1] in one call to C
+function stable.getpath(obj, ...)
+	local keys, typename, id_name, _, _, element = _path(obj, ...)
+	local n = select("#", ...)
+	local v = c.getpath(obj.__handle, unpack(keys))
+	if v == nil then
+		return
+	elseif id_name then
+		return assert(id_name[v], v)
+	elseif type(v) == "userdata" and type(typename) == "string" then
+		if string.byte(typename) == 42 then
+			return _bind_array({ __handle = v }, typename)
+		end
+		local typeinfo = _typeinfo[typename]
+		local sobj = _bind(v, typeinfo)
+		if element and typeinfo.index then
+			-- link it to its array, so a write of the indexed field updates the index
+			local arr = n == 1 and obj or stable.getpath(obj, unpack({ ... }, 1, n - 1))
+			_link(arr, keys[n], sobj)
+		end
+		return sobj
+	end
+	return v
+end
+
+-- stable.setpath(obj, "bars", 2, "second", 10) sets obj.bars[2].second = 10 (not a table value)
+function stable.setpath(obj, ...)
+	local n = select("#", ...)
+	local args = { ... }
+	local v = args[n]
+	assert(n > 1 and type(v) ~= "table", "Need a path and a value")
+	local keys, _, _, name_id, indexed = _path(obj, unpack(args, 1, n - 1))
+	if indexed then
+		-- go through the objects, so the index is updated
+		for i = 1, n - 2 do
+			obj = obj[args[i]]
+		end
+		obj[args[n-1]] = v
+		return
+	end
+	if name_id then
+		v = assert(name_id[v], v)
+	end
+	keys[n] = v
+	c.setpath(obj.__handle, unpack(keys, 1, n))
+end
+
+-- Find an element of an array of structs by its indexed field, returns the element and its position.
+-- The index is checked against the element, so readers never get a wrong element while it's updated.
+function stable.find(arr, value)
+	local field = assert(_index_field(arr), "The array has no index")
+	local typeinfo = _typeinfo[arr.__type]
+	local index = typeinfo.get[field]
+	local name_id = typeinfo.set[index]
+	if name_id then
+		value = name_id[value]
+		if value == nil then
+			return
+		end
+	end
+	local h = stable_get(arr.__handle, 'i')
+	local key = _index_key(value)
+	local pos = h and stable_get(h, key)
+	local n = stable_get(arr.__handle, 's')
+	if pos and pos > 0 and pos <= n then
+		local elem = stable_get(arr.__handle, pos)
+		if elem and stable_get(elem, index) == value then
+			return arr[pos], pos
+		end
+	end
+	-- the index missed (a duplicate value, or a write out of the index) : scan, and fix it
+	for i = 1, n do
+		local elem = stable_get(arr.__handle, i)
+		if elem and stable_get(elem, index) == value then
+			if h then
+				stable_set(h, key, i)
 			end
+			return arr[i], i
+		end
+	end
+	if h and pos and pos ~= 0 then
+		stable_set(h, key, 0)
+	end
+end
+
+-- Number kernels over a "*number" (or "*integer") array, each is one call to C
+
+function stable.sum(arr)
+	return (c.sum(arr.__handle, 1, #arr))
+end
+
+function stable.minmax(arr)
+	return c.minmax(arr.__handle, 1, #arr)
+end
+
+-- op is "<", "<=", "==", "~=", ">=" or ">"
+function stable.count_if(arr, op, v)
+	return c.count(arr.__handle, op, v, 1, #arr)
+end
+
+function stable.find_first(arr, op, v)
+	return c.findfirst(arr.__handle, op, v, 1, #arr)
+end
+
+function stable.memory(obj)
+	return c.memory(obj.__handle)
+end
+
+-- Growing clones the element prototype into the array in C, shrinking resets the removed elements.
+function stable.resize(t,size)
+	local n = assert(stable_get(t.__handle,'s'))
+	c.resize(t.__handle, t.__proto, size)
+	if size > n then
+		local field = _index_field(t)
+		if field then
+			-- the new elements have the same default, the index keeps the last one
+			local obj = t[size]
+			_index_update(t, size, nil, stable_get(obj.__handle, obj.__get[field]))
+		end
+	else
+		for i = size+1, n do
+			rawset(t,i,nil)
 		end
 	end
-	stable_set(t.__handle,'s',size)
 end
 
 return stable
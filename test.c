@@ -2,6 +2,7 @@
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <inttypes.h>
 
@@ -43,6 +44,11 @@ dump(struct table *root, int depth) {
 			printf("%" PRIu64,id);
 			break;
 		}
+		case ST_INTEGER: {
+			int64_t n = stable_integer(root, keys[i].key, keys[i].sz_idx);
+			printf("%" PRId64,n);
+			break;
+		}
 		case ST_STRING:
 			stable_string(root,keys[i].key, keys[i].sz_idx, print_string, NULL);
 			break;
@@ -66,14 +72,399 @@ test(struct table *root) {
 	struct table * sub = stable_create();
 	stable_settable(root,TKEY("hello"),sub);
 	stable_setnumber(root,TINDEX(10),100);
+	stable_setinteger(root,TKEY("integer"),-(1LL<<60));
+	assert(stable_integer(root,TKEY("integer")) == -(1LL<<60));
+	assert(stable_setnumber(root,TKEY("integer"),1) != 0);
 	stable_setstring(sub,TINDEX(0),TKEY("world"));
 	dump(root,0);
 }
 
+static void
+test_view(struct table *root) {
+	struct table_string view;
+	stable_setstring(root,TKEY("view"),TKEY("a long string is pinned"));
+	int r = stable_string_view(root,TKEY("view"),&view);
+	assert(r == 1);
+	stable_setstring(root,TKEY("view"),TKEY("replaced by another long string"));
+	// the view still sees the old value
+	assert(strcmp(view.str,"a long string is pinned") == 0);
+	stable_string_release(&view);
+	stable_setstring(root,TKEY("short"),TKEY("short"));
+	r = stable_string_view(root,TKEY("short"),&view);
+	assert(r == 1 && strcmp(view.str,"short") == 0);
+	stable_setstring(root,TKEY("short"),TKEY("now it is a long string"));
+	assert(strcmp(view.str,"short") == 0);
+	stable_string_release(&view);
+	r = stable_string_view(root,TKEY("none"),&view);
+	assert(r == 0 && view.sz == 0);
+	stable_string_release(&view);
+	// a number is not a string
+	stable_setnumber(root,TINDEX(20),1);
+	r = stable_string_view(root,TINDEX(20),&view);
+	assert(r == 0 && view.sz == 0);
+	stable_string_release(&view);
+}
+
+static void
+test_inplace(struct table *root) {
+	char buf[64];
+	struct stable_memory before, after;
+	stable_setstring(root,TKEY("status"),TKEY("status string 0000"));
+	stable_memory(root,&before);
+	int i;
+	for (i=0;i<1000;i++) {
+		int n = sprintf(buf, "status string %04d", i);
+		stable_setstring(root,TKEY("status"),buf,n);
+	}
+	// a string that fits in the slot is rewritten, nothing is allocated
+	stable_memory(root,&after);
+	assert(after.total == before.total);
+	struct table_string view;
+	stable_string_view(root,TKEY("status"),&view);
+	assert(strcmp(view.str,"status string 0999") == 0);
+	// a pinned slot is replaced
+	stable_setstring(root,TKEY("status"),TKEY("status string next"));
+	assert(strcmp(view.str,"status string 0999") == 0);
+	stable_string_release(&view);
+	stable_setstring(root,TKEY("status"),TKEY("a status string too long for the slot"));
+	stable_string_view(root,TKEY("status"),&view);
+	assert(strcmp(view.str,"a status string too long for the slot") == 0);
+	stable_string_release(&view);
+}
+
+static void
+test_sparse() {
+	struct table * t = stable_create();
+	struct stable_memory m;
+	stable_setnumber(t,TINDEX(1000000),1);
+	stable_memory(t,&m);
+	// a single large index does not allocate a dense array
+	assert(m.total < 4096);
+	int i;
+	for (i=0;i<100;i++) {
+		stable_setnumber(t,TINDEX(i),i);
+	}
+	for (i=0;i<100;i++) {
+		assert(stable_number(t,TINDEX(i)) == i);
+	}
+	assert(stable_number(t,TINDEX(1000000)) == 1);
+	union table_value v;
+	assert(stable_type(t,TINDEX(100),&v) == ST_NIL);
+	stable_release(t);
+	// many integer keys in the map don't make each insert scan the map
+	t = stable_create();
+	for (i=0;i<50000;i++) {
+		stable_setnumber(t,TINDEX(1000000 + i),i);
+	}
+	for (i=0;i<50000;i++) {
+		stable_setnumber(t,TINDEX(i * 4),i);
+	}
+	size_t narr, nhash;
+	stable_size(t,&narr,&nhash);
+	assert(narr + nhash == 100000 && nhash >= 50000);
+	stable_release(t);
+}
+
+static void
+count_value(void *ud, const struct table_key *key, union table_value *v) {
+	int *count = ud;
+	assert(key->type != ST_NIL);
+	if (key->key == NULL && key->sz_idx == 10) {
+		assert(key->type == ST_NUMBER && v->n == 100);
+	}
+	++*count;
+}
+
+static void
+test_foreach(struct table *root) {
+	size_t narr, nhash;
+	int count = 0;
+	stable_size(root, &narr, &nhash);
+	size_t n = stable_foreach(root, count_value, &count);
+	assert(n == count && n == narr + nhash);
+}
+
+static void
+test_grow() {
+	struct table * t = stable_create();
+	int i;
+	// small arrays are copied, from ARRAY_CHUNK slots on the chunks are shared
+	for (i=0;i<4096;i++) {
+		stable_setinteger(t, TINDEX(i), i);
+	}
+	stable_setstring(t, TINDEX(4096), TKEY("a string longer than a short string"));
+	for (i=0;i<4096;i++) {
+		assert(stable_integer(t, TINDEX(i)) == i);
+	}
+	struct table_string view;
+	stable_string_view(t, TINDEX(4096), &view);
+	assert(strcmp(view.str, "a string longer than a short string") == 0);
+	stable_string_release(&view);
+	size_t narr, nhash;
+	stable_size(t, &narr, &nhash);
+	assert(narr == 4097 && nhash == 0);
+	stable_release(t);
+}
+
+static void
+test_batch() {
+	struct table * t = stable_create();
+	struct table_entry e[102];
+	int i;
+	for (i=0;i<100;i++) {
+		e[i].key.type = ST_INTEGER;
+		e[i].key.key = NULL;
+		e[i].key.sz_idx = i;
+		e[i].v.i = i;
+	}
+	e[100].key.type = ST_STRING;
+	e[100].key.key = "name";
+	e[100].key.sz_idx = 4;
+	e[100].v.p = "a string longer than a short one";
+	e[100].sz = strlen(e[100].v.p);
+	e[101].key.type = ST_NUMBER;
+	e[101].key.key = NULL;
+	e[101].key.sz_idx = 0;	// slot 0 is an integer
+	e[101].v.n = 1;
+	assert(stable_setbatch(t, e, 102) == 1);
+	assert(e[101].key.type == ST_NIL);
+	for (i=0;i<100;i++) {
+		assert(stable_integer(t,TINDEX(i)) == i);
+	}
+	struct table_string view;
+	stable_string_view(t, "name", 4, &view);
+	assert(view.sz == e[100].sz && memcmp(view.str, e[100].v.p, view.sz) == 0);
+	stable_string_release(&view);
+	// all integer keys are in the array part, the string is the only map key
+	size_t narr, nhash;
+	stable_size(t, &narr, &nhash);
+	assert(narr == 100 && nhash == 1);
+	stable_release(t);
+}
+
+static void
+test_path(struct table *root) {
+	struct table_key path[3] = {
+		{ ST_NIL, TKEY("hello") },
+		{ ST_NIL, TINDEX(0) },
+		{ ST_NIL, TINDEX(1) },
+	};
+	union table_value v;
+	// root.hello[0] is "world"
+	assert(stable_getpath(root, path, 2, &v) == ST_STRING);
+	assert(stable_path(root, path, 1) == stable_table(root, TKEY("hello")));
+	// root.hello[0] is not a table
+	assert(stable_getpath(root, path, 3, &v) == ST_NIL);
+	assert(stable_path(root, path, 2) == NULL);
+}
+
+static void
+test_kernel() {
+	struct table * t = stable_create();
+	int i;
+	for (i=0;i<1000;i++) {
+		stable_setnumber(t, TINDEX(i), i);
+	}
+	stable_setstring(t, TINDEX(1000), TKEY("skipped"));
+	stable_setinteger(t, TINDEX(1001), 2000);
+	size_t count;
+	assert(stable_sum(t, 0, 1002, &count) == 999 * 1000 / 2 + 2000 && count == 1001);
+	double min, max;
+	assert(stable_minmax(t, 10, 20, &min, &max) && min == 10 && max == 19);
+	assert(stable_minmax(t, 1000, 1001, &min, &max) == 0);
+	assert(stable_count_if(t, 0, 1002, ST_GE, 500) == 501);
+	assert(stable_count_if(t, 0, 1002, ST_NE, 1) == 1000);
+	size_t idx;
+	assert(stable_find_first(t, 100, 1002, ST_GT, 998.5, &idx) && idx == 999);
+	assert(stable_find_first(t, 0, 1002, ST_LT, 0, &idx) == 0);
+	// sparse keys in the map
+	for (i=0;i<100;i++) {
+		stable_setinteger(t, TINDEX(1000000 + (99 - i) * 3), i);
+	}
+	assert(stable_sum(t, 1000000, 1000300, &count) == 99 * 100 / 2 && count == 100);
+	assert(stable_find_first(t, 1000000, 1000300, ST_LE, 50, &idx) && idx == 1000000 + 49 * 3);
+	assert(stable_count_if(t, 0, 1000300, ST_GE, 2000) == 1);
+	assert(stable_freeze(t) == 0);
+	assert(stable_sum(t, 0, (size_t)-1, &count) == 999 * 1000 / 2 + 2000 + 99 * 100 / 2 && count == 1101);
+	assert(stable_find_first(t, 1000, (size_t)-1, ST_LE, 50, &idx) && idx == 1000000 + 49 * 3);
+	stable_release(t);
+}
+
+static void
+test_cycle() {
+	struct table * root = stable_create();
+	struct stable_memory before, after;
+	stable_settable(root, TKEY("c"), NULL);
+	stable_memory(root, &before);
+	stable_collect_start();
+	// a <-> b is garbage once the caller releases a
+	struct table * a = stable_create_child(root);
+	struct table * b = stable_create_child(root);
+	stable_settable(a, TKEY("b"), b);
+	stable_grab(a);
+	stable_settable(b, TKEY("a"), a);
+	stable_release(a);
+	// e.self = e
+	struct table * e = stable_create_child(root);
+	stable_grab(e);
+	stable_settable(e, TKEY("self"), e);
+	stable_release(e);
+	// c <-> d is still referenced by root
+	struct table * c = stable_create_child(root);
+	struct table * d = stable_create_child(root);
+	stable_settable(c, TKEY("d"), d);
+	stable_grab(c);
+	stable_settable(d, TKEY("c"), c);
+	stable_settable(root, TKEY("c"), c);
+	stable_grab(c);
+	stable_release(c);
+	assert(stable_collect() == 3);
+	assert(stable_getref(c) == 2 && stable_table(d, TKEY("c")) == c);
+	assert(stable_collect_stop() == 0);
+	stable_settable(c, TKEY("d"), NULL);
+	stable_settable(root, TKEY("c"), NULL);
+	stable_memory(root, &after);
+	assert(after.total == before.total);
+	stable_release(root);
+}
+
+struct buffer {
+	char *p;
+	size_t sz;
+};
+
+static void
+write_buffer(void *ud, const char *str, size_t sz) {
+	struct buffer *b = ud;
+	b->p = realloc(b->p, b->sz + sz);
+	memcpy(b->p + b->sz, str, sz);
+	b->sz += sz;
+}
+
+static void
+test_msgpack() {
+	struct table * t = stable_create();
+	struct table * sub = stable_create_child(t);
+	int i;
+	for (i=0;i<100;i++) {
+		stable_setinteger(t, TINDEX(i), i * 1000 - 50000);
+	}
+	stable_setnumber(t, TINDEX(1000000), 0.5);
+	stable_setboolean(t, TKEY("bool"), 1);
+	stable_setid(t, TKEY("id"), 0x123456789abcdefULL);
+	stable_setstring(t, TKEY("short"), TKEY("short"));
+	stable_setstring(sub, TKEY("long"), TKEY("a string longer than a short string"));
+	stable_settable(t, TKEY("sub"), sub);
+	struct buffer b = { NULL, 0 };
+	assert(stable_encode_msgpack(t, write_buffer, &b) == 0);
+	size_t used;
+	struct table * c = stable_decode_msgpack(NULL, b.p, b.sz, &used);
+	assert(c && used == b.sz);
+	for (i=0;i<100;i++) {
+		assert(stable_integer(c, TINDEX(i)) == i * 1000 - 50000);
+	}
+	assert(stable_number(c, TINDEX(1000000)) == 0.5);
+	assert(stable_boolean(c, TKEY("bool")) == 1);
+	assert(stable_id(c, TKEY("id")) == 0x123456789abcdefULL);
+	struct table_string view;
+	stable_string_view(c, TKEY("short"), &view);
+	assert(strcmp(view.str, "short") == 0);
+	stable_string_release(&view);
+	struct table * csub = stable_table(c, TKEY("sub"));
+	stable_string_view(csub, TKEY("long"), &view);
+	assert(strcmp(view.str, "a string longer than a short string") == 0);
+	stable_string_release(&view);
+	size_t narr, nhash;
+	stable_size(c, &narr, &nhash);
+	assert(narr == 100);
+	// truncated
+	assert(stable_decode_msgpack(NULL, b.p, b.sz - 1, NULL) == NULL);
+	free(b.p);
+	stable_release(c);
+	stable_release(t);
+}
+
+static void
+count_key(void *ud, const struct table_key *key, union table_value *v) {
+	++*(int *)ud;
+}
+
+static void
+test_freeze() {
+	struct table * t = stable_create();
+	struct table * s = stable_create_sharded(t, 4);
+	struct table * sub = stable_create_child(t);
+	char key[32];
+	int i;
+	for (i=0;i<100;i++) {
+		stable_setinteger(t, TINDEX(i), i);
+		sprintf(key, "key%d", i);
+		stable_setnumber(t, key, strlen(key), i);
+		stable_setnumber(s, key, strlen(key), i);
+	}
+	stable_setnumber(t, TINDEX(1000000), 0.5);
+	stable_setstring(t, TKEY("short"), TKEY("short"));
+	stable_setstring(sub, TINDEX(0), TKEY("a string longer than a short string"));
+	stable_settable(t, TKEY("sub"), sub);
+	stable_settable(t, TKEY("shard"), s);
+	struct stable_memory before, after;
+	stable_memory(t, &before);
+	assert(stable_freeze(t) == 0);
+	stable_memory(t, &after);
+	assert(after.total < before.total);
+	assert(stable_frozen(t) && stable_frozen(sub) && stable_frozen(s));
+	for (i=0;i<100;i++) {
+		assert(stable_integer(t, TINDEX(i)) == i);
+		sprintf(key, "key%d", i);
+		assert(stable_number(t, key, strlen(key)) == i);
+		assert(stable_number(s, key, strlen(key)) == i);
+	}
+	assert(stable_number(t, TINDEX(1000000)) == 0.5);
+	union table_value v;
+	assert(stable_type(t, TKEY("none"), &v) == ST_NIL);
+	assert(stable_type(t, TINDEX(100), &v) == ST_NIL);
+	struct table_string view;
+	stable_string_view(t, TKEY("short"), &view);
+	assert(strcmp(view.str, "short") == 0);
+	stable_string_release(&view);
+	stable_string_view(sub, TINDEX(0), &view);
+	assert(strcmp(view.str, "a string longer than a short string") == 0);
+	stable_string_release(&view);
+	assert(stable_table(t, TKEY("sub")) == sub);
+	// writes fail
+	assert(stable_setnumber(t, "key0", 4, 1) != 0);
+	assert(stable_setinteger(t, TINDEX(200), 1) != 0);
+	assert(stable_settable(t, TKEY("sub"), NULL) != 0);
+	assert(stable_number(t, "key0", 4) == 0);
+	size_t narr, nhash;
+	stable_size(t, &narr, &nhash);
+	assert(narr == 100 && nhash == 104);
+	int count = 0;
+	assert(stable_foreach(t, count_key, &count) == 204 && count == 204);
+	struct buffer b = { NULL, 0 };
+	assert(stable_encode_msgpack(t, write_buffer, &b) == 0);
+	struct table * c = stable_decode_msgpack(NULL, b.p, b.sz, NULL);
+	assert(stable_number(stable_table(c, TKEY("shard")), "key99", 5) == 99);
+	free(b.p);
+	stable_release(c);
+	stable_release(t);
+}
+
 int
 main() {
 	struct table * t = stable_create();
 	test(t);
+	test_view(t);
+	test_inplace(t);
+	test_sparse();
+	test_foreach(t);
+	test_path(t);
+	test_batch();
+	test_grow();
+	test_kernel();
+	test_cycle();
+	test_msgpack();
+	test_freeze();
 	stable_release(t);
 	return 0;
 }
@@ -14,8 +14,8 @@
 static struct table *
 init() {
 	struct table * t = stable_create();
-	struct table * sub1 = stable_create();
-	struct table * sub2 = stable_create();
+	struct table * sub1 = stable_create_child(t);
+	struct table * sub2 = stable_create_child(t);
 	stable_settable(t, TKEY("number"),sub1);
 	stable_settable(t, TKEY("string"),sub2);
 	stable_setnumber(t,TKEY("count"),0);
@@ -57,6 +57,8 @@ thread_read(void* ptr) {
 	struct table * n = stable_table(t, TKEY("number"));
 	struct table * s = stable_table(t, TKEY("string"));
 	char buf[32];
+	// count is read in a loop, most reads hit the cache between two writes
+	stable_cache_enable(1);
 	while (last != MAX_COUNT) {
 		int i = stable_number(t,TKEY("count"));
 		if (i == last)
@@ -76,8 +78,11 @@ thread_read(void* ptr) {
 		}
 		assert((int)d == i);
 	}
+	uint64_t hit, miss;
+	stable_cache_stats(&hit, &miss);
+	stable_cache_enable(0);
 
-	return NULL;
+	return (void *)(intptr_t)(hit * 100 / (hit + miss + 1));
 }
 
 static void
@@ -99,6 +104,153 @@ test_read(struct table *t) {
 	}
 }
 
+#define BUILD_THREAD 4
+#define BUILD_COUNT 10000
+#define BUILD_ROUND 8
+
+struct build {
+	struct table *root;
+	struct table *sub;
+	int version;
+};
+
+static void *
+thread_build(void *ptr) {
+	struct build *b = ptr;
+	// each builder owns its detached table, no lock is taken
+	b->sub = stable_create_detached(b->root);
+	int i;
+	for (i=0;i<BUILD_COUNT;i++) {
+		stable_setnumber(b->sub, TINDEX(i), b->version);
+	}
+	return NULL;
+}
+
+static volatile int build_done;
+
+static void *
+thread_check(void *ptr) {
+	struct table * t = ptr;
+	while (!build_done) {
+		struct table * root = stable_table(t, TKEY("config"));
+		if (root == NULL)
+			continue;
+		// a reader sees one version of the whole tree
+		int version = stable_number(root, TKEY("version"));
+		int i;
+		for (i=0;i<BUILD_THREAD;i++) {
+			struct table * sub = stable_table(root, TINDEX(i));
+			assert(sub);
+			assert(stable_number(sub, TINDEX(0)) == version);
+			assert(stable_number(sub, TINDEX(BUILD_COUNT-1)) == version);
+		}
+	}
+	return NULL;
+}
+
+static void
+test_swap(struct table *T) {
+	pthread_t pid[BUILD_THREAD];
+	pthread_t reader[BUILD_THREAD];
+	struct table * old[BUILD_ROUND];
+	struct build b[BUILD_THREAD];
+	int i,j;
+	for (i=0;i<BUILD_THREAD;i++) {
+		pthread_create(&reader[i], NULL, thread_check, T);
+	}
+	for (i=0;i<BUILD_ROUND;i++) {
+		struct table * root = stable_create_detached(T);
+		for (j=0;j<BUILD_THREAD;j++) {
+			b[j].root = root;
+			b[j].version = i;
+			pthread_create(&pid[j], NULL, thread_build, &b[j]);
+		}
+		for (j=0;j<BUILD_THREAD;j++) {
+			pthread_join(pid[j], NULL);
+			stable_settable(root, TINDEX(j), b[j].sub);
+		}
+		stable_setnumber(root, TKEY("version"), i);
+		int r = stable_swap_table(T, TKEY("config"), root, &old[i]);
+		assert(r == 0 && (i == 0) == (old[i] == NULL));
+	}
+	build_done = 1;
+	for (i=0;i<BUILD_THREAD;i++) {
+		pthread_join(reader[i], NULL);
+	}
+	// readers are gone, release the replaced trees
+	for (i=0;i<BUILD_ROUND;i++) {
+		stable_release(old[i]);
+	}
+	printf("swap %d trees\n", BUILD_ROUND);
+}
+
+#define RECLAIM_DEPTH 100000
+
+static void
+test_reclaim(struct table *T) {
+	struct stable_memory before, after;
+	stable_memory(T, &before);
+	int r = stable_reclaim_start();
+	assert(r == 0);
+	// a deep chain would overflow the stack if it was freed recursively
+	struct table * root = stable_create_child(T);
+	struct table * t = root;
+	int i;
+	for (i=0;i<RECLAIM_DEPTH;i++) {
+		struct table * sub = stable_create_child(T);
+		stable_setnumber(sub, TKEY("depth"), i);
+		stable_settable(t, TKEY("next"), sub);
+		t = sub;
+	}
+	stable_release(root);	// only queued
+	stable_reclaim_flush();
+	stable_memory(T, &after);
+	assert(after.total == before.total);
+	stable_reclaim_stop();
+	printf("reclaim %d tables\n", RECLAIM_DEPTH + 1);
+}
+
+#define RECLAIM_THREAD 4
+#define RECLAIM_ROUND 200
+
+static volatile int reclaim_done = 0;
+
+static void *
+thread_release(void *ud) {
+	struct table *T = ud;
+	while (!reclaim_done) {
+		struct table * t = stable_create_child(T);
+		stable_setnumber(t, TKEY("x"), 1);
+		stable_release(t);
+	}
+	return NULL;
+}
+
+// releases racing with start / stop : none of the trees is leaked
+static void
+test_reclaim_stop(struct table *T) {
+	struct stable_memory before, after;
+	stable_memory(T, &before);
+	pthread_t pid[RECLAIM_THREAD];
+	int i;
+	for (i=0;i<RECLAIM_THREAD;i++) {
+		pthread_create(&pid[i], NULL, thread_release, T);
+	}
+	for (i=0;i<RECLAIM_ROUND;i++) {
+		int r = stable_reclaim_start();
+		assert(r == 0);
+		usleep(1000);
+		stable_reclaim_stop();
+	}
+	reclaim_done = 1;
+	for (i=0;i<RECLAIM_THREAD;i++) {
+		pthread_join(pid[i], NULL);
+	}
+	stable_memory(T, &after);
+	assert(after.total == before.total);
+	printf("reclaim start/stop %d rounds\n", RECLAIM_ROUND);
+}
+
 int 
 main() {
 	pthread_t pid[MAX_THREAD];
@@ -113,15 +265,36 @@ main() {
 		pthread_create(&pid[i], NULL, thread_read, T);
 	}
 
+	int hit = 0;
 	for (i=0;i<MAX_THREAD;i++) {
-		pthread_join(pid[i], NULL); 
+		void *r;
+		pthread_join(pid[i], &r); 
+		hit += (intptr_t)r;
 	}
 
-	printf("main exit\n");
+	printf("main exit, cache hit %d%%\n", hit / (MAX_THREAD-1));
 
 	test_read(T);
+	test_swap(T);
+	test_reclaim(T);
+	test_reclaim_stop(T);
+
+	struct stable_memory mem;
+	stable_memory(T, &mem);
+	printf("memory total=%" PRIuPTR " retired=%" PRIuPTR "\n", mem.total, mem.retired);
+	assert(mem.retired == 0);
 
 	stable_release(T);
 
+	struct stable_stats st;
+	if (stable_stats(&st)) {
+		printf("retry map=%" PRIu64 " array=%" PRIu64 "\n", st.map_retry, st.array_retry);
+		printf("spin lock=%" PRIu64 " grab=%" PRIu64 "\n", st.lock_spin, st.grab_spin);
+		printf("expand hash=%" PRIu64 " array=%" PRIu64 "\n", st.hash_expand, st.array_expand);
+		printf("probe avg=%f max=%" PRIu64 "\n", st.lookup ? (double)st.probe / st.lookup : 0, st.probe_max);
+		printf("live map=%" PRId64 " array=%" PRId64 "\n", st.map_live, st.array_live);
+		assert(st.map_live == 0 && st.array_live == 0);
+	}
+
 	return 0;
 }
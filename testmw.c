@@ -0,0 +1,179 @@
+#include "stable.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/time.h>
+
+#define MAX_THREAD 16
+#define MAX_COUNT 20000
+
+struct writer {
+	struct table *t;
+	int id;
+	int post;
+};
+
+static double
+now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void
+write_number(struct writer *w, const char *key, size_t sz, double v) {
+	if (w->post) {
+		struct table_entry e;
+		e.key.type = ST_NUMBER;
+		e.key.key = key;
+		e.key.sz_idx = sz;
+		e.v.n = v;
+		stable_post(w->t, &e);
+	} else {
+		stable_setnumber(w->t, key, sz, v);
+	}
+}
+
+static void *
+thread_write(void *ptr) {
+	struct writer *w = ptr;
+	char buf[32];
+	int i;
+	for (i=0;i<MAX_COUNT;i++) {
+		int n = sprintf(buf, "%d-%d", w->id, i);
+		write_number(w, buf, n, i);
+	}
+	// update the same keys again, nothing is inserted this time
+	for (i=0;i<MAX_COUNT;i++) {
+		int n = sprintf(buf, "%d-%d", w->id, i);
+		write_number(w, buf, n, i + 1);
+	}
+	return NULL;
+}
+
+static void *
+thread_add(void *ptr) {
+	struct table *t = ptr;
+	int i;
+	for (i=0;i<MAX_COUNT;i++) {
+		stable_addinteger(t, TKEY("count"), 1, NULL);
+		stable_maxnumber(t, TKEY("max"), i, NULL);
+	}
+	return NULL;
+}
+
+// no update is lost with concurrent read-modify-write
+static void
+test_add() {
+	pthread_t pid[MAX_THREAD];
+	struct table * t = stable_create();
+	int i;
+	for (i=0;i<MAX_THREAD;i++) {
+		pthread_create(&pid[i], NULL, thread_add, t);
+	}
+	for (i=0;i<MAX_THREAD;i++) {
+		pthread_join(pid[i], NULL);
+	}
+	assert(stable_integer(t, TKEY("count")) == MAX_THREAD * MAX_COUNT);
+	assert(stable_number(t, TKEY("max")) == MAX_COUNT - 1);
+	union table_value expect, v;
+	expect.i = MAX_THREAD * MAX_COUNT;
+	v.i = 0;
+	assert(stable_cas(t, TKEY("count"), ST_INTEGER, &expect, &v) == 1);
+	assert(stable_cas(t, TKEY("count"), ST_INTEGER, &expect, &v) == 0);
+	assert(stable_addnumber(t, TKEY("count"), 1, NULL) == 1);
+	stable_release(t);
+	printf("%d writers add %d times\n", MAX_THREAD, MAX_COUNT);
+}
+
+static void
+check(struct table *t, int nthread) {
+	char buf[32];
+	int i,j;
+	for (i=0;i<nthread;i++) {
+		for (j=0;j<MAX_COUNT;j++) {
+			int n = sprintf(buf, "%d-%d", i, j);
+			assert(stable_number(t, buf, n) == j + 1);
+		}
+	}
+	size_t narr, nhash;
+	stable_size(t, &narr, &nhash);
+	assert(narr == 0 && nhash == (size_t)nthread * MAX_COUNT);
+}
+
+// a poster reads its own writes with the ticket, the last write of a key in a batch wins
+static void
+test_post() {
+	struct table * t = stable_create();
+	struct table * sub = stable_create_child(t);
+	struct table_entry e;
+	int i;
+	e.key.type = ST_STRING;
+	e.key.key = "name";
+	e.key.sz_idx = 4;
+	e.v.p = "a string longer than a short string";
+	e.sz = strlen(e.v.p);
+	uint64_t ticket = stable_post(t, &e);
+	stable_sync(t, ticket);
+	struct table_string view;
+	stable_string_view(t, "name", 4, &view);
+	assert(view.sz == e.sz && memcmp(view.str, e.v.p, e.sz) == 0);
+	stable_string_release(&view);
+	e.key.key = NULL;
+	e.key.type = ST_INTEGER;
+	for (i=0;i<100;i++) {
+		e.key.sz_idx = i % 10;
+		e.v.i = i;
+		stable_post(t, &e);
+	}
+	e.key.type = ST_TABLE;
+	e.key.sz_idx = 10;
+	e.v.p = sub;
+	stable_post(t, &e);
+	stable_sync(t, 0);
+	for (i=0;i<10;i++) {
+		assert(stable_integer(t, TINDEX(i)) == 90 + i);
+	}
+	assert(stable_table(t, TINDEX(10)) == sub);
+	stable_release(t);
+}
+
+static double
+bench(struct table *t, int nthread, int post) {
+	pthread_t pid[MAX_THREAD];
+	struct writer w[MAX_THREAD];
+	int i;
+	double start = now();
+	for (i=0;i<nthread;i++) {
+		w[i].t = t;
+		w[i].id = i;
+		w[i].post = post;
+		pthread_create(&pid[i], NULL, thread_write, &w[i]);
+	}
+	for (i=0;i<nthread;i++) {
+		pthread_join(pid[i], NULL);
+	}
+	if (post) {
+		stable_sync(t, 0);
+	}
+	double elapsed = now() - start;
+	check(t, nthread);
+	stable_release(t);
+	return nthread * MAX_COUNT * 2 / elapsed;
+}
+
+int
+main() {
+	test_add();
+	test_post();
+	int n;
+	for (n=1;n<=MAX_THREAD;n*=4) {
+		double single = bench(stable_create(), n, 0);
+		double sharded = bench(stable_create_sharded(NULL, MAX_THREAD * 4), n, 0);
+		double posted = bench(stable_create(), n, 1);
+		printf("%2d writers : single lock %.0f writes/s, sharded %.0f writes/s, posted %.0f writes/s\n", n, single, sharded, posted);
+	}
+	return 0;
+}
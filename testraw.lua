@@ -16,3 +16,11 @@ local function dump(a, depth)
 end
 
 dump(a,0)
+
+-- integer keys may be sparse, large or <= 0, a float key must have an integer value
+local t = s.create()
+t[1 << 40] = 1 ; t[0] = 2 ; t[-1] = 3 ; t[2.0] = 4
+assert(t[1 << 40] == 1 and t[0] == 2 and t[-1] == 3 and t[2] == 4)
+assert(not pcall(function() t[1.5] = 5 end))
+assert(not pcall(function() return t[1.5] end))
+assert(t[0] == 2)
@@ -1,10 +1,15 @@
 local print_r = require "print_r"
 local stable = require "stable"
 
-local info = stable.init {
+local types = {
 	foo = {
 		bars = "*bar",	-- struct bar array
 		enums = "*xx",
+		items = "*item",
+	},
+	item = {
+		key1 = 0,
+		index = "key1",
 	},
 	bar = {
 		first = true,
@@ -13,6 +18,7 @@ local info = stable.init {
 	},
 	xx = { "ONE", "TWO" }
 }
+local info = stable.init(types)
 
 local a = stable.create "foo"
 
@@ -39,3 +45,30 @@ a.bars[2].third[2] = "TWO"
 stable.resize(a.bars,1)
 
 print_r(a)
+
+-- the index of items is on key1, find checks it against the elements
+local items = stable.getpath(a, "items")
+for i=1,3 do
+	items[i] = { key1 = i }
+end
+assert(stable.find(items, 2) == items[2])
+-- duplicate values
+items[1].key1 = 5
+items[2].key1 = 5
+items[2].key1 = 6
+local item, pos = stable.find(items, 5)
+assert(pos == 1 and item.key1 == 5)
+assert(select(2, stable.find(items, 6)) == 2)
+-- writes through getpath and out of the index
+stable.getpath(a, "items", 3).key1 = 42
+assert(select(2, stable.find(a.items, 42)) == 3)
+local raw = require "stable.raw"
+raw.set(items[1].__handle, items[1].__get.key1, 7)
+assert(select(2, stable.find(a.items, 7)) == 1)
+assert(stable.find(a.items, 5) == nil)
+
+-- init again : the arrays bound before keep their prototype
+stable.init(types)
+collectgarbage()
+stable.resize(a.bars, 4)
+assert(a.bars[4].second == 1)